@@ -21,10 +21,12 @@
 #include "WUP.h"
 #include "ARM.h"
 #include "ARMInterpreter.h"
+#include "ARMJIT.h"
 #include "Platform.h"
 
 using Platform::Log;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 
 u32 ARM::ConditionTable[16] =
@@ -73,6 +75,7 @@ void ARM::Reset()
     Halted = 0;
 
     IRQ = 0;
+    IdleLoop = 0;
 
     for (int i = 0; i < 16; i++)
         R[i] = 0;
@@ -108,6 +111,52 @@ void ARMv5::Reset()
     ARM::Reset();
 }
 
+void ARM::DoSavestate(Savestate* file)
+{
+    file->Section("ARM9");
+
+    file->Var32((u32*)&Cycles);
+    file->Var32(&StopExecution);
+
+    file->Var32(&CodeRegion);
+    file->Var32((u32*)&CodeCycles);
+    file->Var32(&DataRegion);
+    file->Var32((u32*)&DataCycles);
+
+    file->VarArray(R, sizeof(R));
+    file->Var32(&CPSR);
+    file->VarArray(R_FIQ, sizeof(R_FIQ));
+    file->VarArray(R_SVC, sizeof(R_SVC));
+    file->VarArray(R_ABT, sizeof(R_ABT));
+    file->VarArray(R_IRQ, sizeof(R_IRQ));
+    file->VarArray(R_UND, sizeof(R_UND));
+    file->Var32(&CurInstr);
+    file->VarArray(NextInstr, sizeof(NextInstr));
+
+    file->Var32(&ExceptionBase);
+
+    if (!file->Saving)
+        SetupCodeMem(R[15]);
+}
+
+void ARMv5::DoSavestate(Savestate* file)
+{
+    ARM::DoSavestate(file);
+
+    file->Section("CP15");
+
+    file->Var32(&CP15Control);
+    file->Var32(&RNGSeed);
+    file->Var32((u32*)&RegionCodeCycles);
+
+    file->VarArray(ICache, sizeof(ICache));
+    file->VarArray(ICacheTags, sizeof(ICacheTags));
+    file->VarArray(ICacheCount, sizeof(ICacheCount));
+
+    if (!file->Saving)
+        CurICacheLine = NULL;
+}
+
 void ARM::SoftReset()
 {
     u32 oldcpsr = CPSR;
@@ -119,6 +168,11 @@ void ARM::SoftReset()
 }
 
 
+void ARM::SetupCodeMem(u32 addr)
+{
+    WUP::ARM9GetMemRegion(addr, false, &CodeMem);
+}
+
 void ARMv5::JumpTo(u32 addr, bool restorecpsr)
 {
     if (restorecpsr)
@@ -132,14 +186,14 @@ void ARMv5::JumpTo(u32 addr, bool restorecpsr)
     //u32 oldregion = R[15] >> 24;
     //u32 newregion = addr >> 24;
 
-    RegionCodeCycles = 1;//MemTimings[addr >> 12][0];
+    RegionCodeCycles = 1;//MemTimings[addr >> WUP::kPageShift][0];
 
     if (addr & 0x1)
     {
         addr &= ~0x1;
         R[15] = addr+2;
 
-        //if (newregion != oldregion) SetupCodeMem(addr);
+        SetupCodeMem(addr);
 
         // two-opcodes-at-once fetch
         // doesn't matter if we put garbage in the MSbs there
@@ -164,7 +218,7 @@ void ARMv5::JumpTo(u32 addr, bool restorecpsr)
         addr &= ~0x3;
         R[15] = addr+4;
 
-        //if (newregion != oldregion) SetupCodeMem(addr);
+        SetupCodeMem(addr);
 
         NextInstr[0] = CodeRead32(addr, true);
         Cycles += CodeCycles;
@@ -399,11 +453,97 @@ void ARMv5::Execute()
                 AddCycles_C();
         }
 
-        if (R[15]==0xB935E) printf("BAKA cmd=%02X\n", R[0]);
+        if (R[15]==0xB935E) Log(LogChannel::Core, LogLevel::Debug, "BAKA cmd=%02X\n", R[0]);
 
         // TODO optimize this shit!!!
         if (Halted)
         {
+            // the target is the next scheduled event (timers included),
+            // nothing can wake the CPU up before that
+            WUP::ARM9Timestamp += Cycles;
+            Cycles = 0;
+            if (Halted == 1 && WUP::ARM9Timestamp < WUP::ARM9Target)
+            {
+                WUP::ARM9Timestamp = WUP::ARM9Target;
+            }
+            break;
+        }
+
+        if (IRQ) TriggerIRQ();
+
+        WUP::ARM9Timestamp += Cycles;
+        Cycles = 0;
+    }
+
+    if (Halted == 2)
+        Halted = 0;
+}
+
+void ARMv5::ExecuteCached()
+{
+    if (Halted)
+    {
+        if (Halted == 2)
+        {
+            Halted = 0;
+        }
+        else if (IRQ)
+        {
+            Halted = 0;
+            TriggerIRQ();
+        }
+        else
+        {
+            WUP::ARM9Timestamp = WUP::ARM9Target;
+            return;
+        }
+    }
+
+    while (WUP::ARM9Timestamp < WUP::ARM9Target)
+    {
+        bool thumb = !!(CPSR & 0x20);
+        u32 addr = R[15] - (thumb ? 2 : 4);
+
+        ARMJIT::JitBlock* block = ARMJIT::LookUpBlock(addr, thumb);
+        if (!block)
+            block = ARMJIT::CompileBlock(this);
+
+        // the block may get invalidated while it runs, which frees it
+        bool idleloop = block->IdleLoop;
+        WUP::TimersPolled = false;
+
+        if (block->Entry)
+        {
+            block->Entry(this);
+        }
+        else
+        {
+            // the decoded instructions stay valid until the next flush though
+            ARMJIT::FetchedInstr* instrs = block->Instrs;
+            u32 num = block->NumInstrs;
+            for (u32 i = 0; i < num; i++)
+            {
+                ARMJIT::FetchedInstr* instr = &instrs[i];
+
+                R[15] = instr->PC;
+                CodeCycles = instr->CodeCycles;
+
+                if (instr->CondMask & (1 << (CPSR >> 28)))
+                {
+                    CurInstr = instr->Instr;
+                    instr->Handler(this);
+                }
+                else
+                    Cycles += instr->CodeCycles;
+            }
+        }
+
+        if (Halted)
+        {
+            // the target is the next scheduled event (timers included),
+            // nothing can wake the CPU up before that
+            WUP::ARM9Timestamp += Cycles;
+            Cycles = 0;
             if (Halted == 1 && WUP::ARM9Timestamp < WUP::ARM9Target)
             {
                 WUP::ARM9Timestamp = WUP::ARM9Target;
@@ -413,8 +553,19 @@ void ARMv5::Execute()
 
         if (IRQ) TriggerIRQ();
 
+        // an idle loop which went back to its start will keep spinning until
+        // something external happens, so skip straight to the next event.
+        // not if it read the timers, they keep counting in between events
+        if (idleloop && !WUP::TimersPolled && R[15] == addr + (thumb ? 2 : 4))
+            IdleLoop = 1;
+
         WUP::ARM9Timestamp += Cycles;
-        WUP::RunTimers();
+        if (IdleLoop)
+        {
+            IdleLoop = 0;
+            if (WUP::ARM9Timestamp < WUP::ARM9Target)
+                WUP::ARM9Timestamp = WUP::ARM9Target;
+        }
         Cycles = 0;
     }
 
@@ -424,7 +575,7 @@ void ARMv5::Execute()
 
 void ARMv5::FillPipeline()
 {
-    //SetupCodeMem(R[15]);
+    SetupCodeMem(R[15]);
 
     if (CPSR & 0x20)
     {
@@ -23,6 +23,7 @@
 
 #include "types.h"
 #include "WUP.h"
+#include "Savestate.h"
 
 inline u32 ROR(u32 x, u32 n)
 {
@@ -46,6 +47,8 @@ public:
     virtual void Reset();
     void SoftReset();
 
+    virtual void DoSavestate(Savestate* file);
+
     virtual void FillPipeline() = 0;
 
     virtual void JumpTo(u32 addr, bool restorecpsr = false) = 0;
@@ -155,7 +158,10 @@ public:
 
     void Reset();
 
-    void UpdateRegionTimings(u32 addrstart, u32 addrend);
+    void DoSavestate(Savestate* file);
+
+    // in 1MB pages, see WUP::SetARM9RegionTimings()
+    void UpdateRegionTimings(u32 pagestart, u32 pageend);
 
     void FillPipeline();
 
@@ -165,9 +171,8 @@ public:
     void DataAbort();
 
     void Execute();
-#ifdef JIT_ENABLED
-    void ExecuteJIT();
-#endif
+    // runs code through the block cache, either compiled or pre-decoded
+    void ExecuteCached();
 
     // all code accesses are forced nonseq 32bit
     u32 CodeRead32(u32 addr, bool branch);
@@ -243,8 +248,8 @@ public:
     u32 ICacheTags[64*4];
     u8 ICacheCount[64];
 
-    // code/16N/32N/32S
-    u8 MemTimings[0x100000][4];
+    // code/16N/32N/32S, per 1MB page
+    u8 MemTimings[WUP::kNumPages][4];
 
     u8* CurICacheLine;
 };
@@ -260,7 +265,7 @@ void T_UNK(ARM* cpu);
 namespace WUP
 {
 
-extern ARMv5* ARM9;
+extern thread_local ARMv5* ARM9;
 
 }
 
@@ -0,0 +1,751 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "WUP.h"
+#include "ARMJIT.h"
+#include "ARMJIT_Internal.h"
+#include "ARMInterpreter.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+// NOTES
+// * blocks are compiled from the current PC up to the first instruction that
+//   may change control flow or the CPU mode, or kMaxBlockLength instructions
+// * blocks are either compiled to native code, or kept as arrays of decoded
+//   instructions which are run by the cached interpreter (ARMv5::ExecuteCached)
+// * only code in main RAM is cached. code running from anywhere else gets
+//   decoded every time, which is slow but there is no reason for it to happen
+// * the pipeline (NextInstr) isn't maintained while running compiled code,
+//   FillPipeline() needs to be called before going back to the interpreter
+
+namespace ARMJIT
+{
+
+const int kMaxBlockLength = 32;
+
+// storage for the decoded instructions of cached blocks
+const u32 kInstrBufferSize = 0x40000;
+thread_local FetchedInstr* InstrBuffer = NULL;
+thread_local u32 InstrBufferOffset;
+
+thread_local bool NativeAvailable;
+thread_local bool Native;
+
+thread_local u8 CodePages[kNumCodePages];
+
+thread_local std::unordered_map<u32, JitBlock> BlockMap;
+thread_local std::vector<u32>* PageBlocks = NULL;
+
+// small direct-mapped cache in front of BlockMap
+struct FastCacheEntry
+{
+    u32 Key;
+    JitBlock* Block;
+};
+
+const u32 kFastCacheBits = 12;
+thread_local FastCacheEntry* FastCache = NULL;
+
+// blocks outside of main RAM aren't cached
+thread_local JitBlock UncachedBlock;
+thread_local FetchedInstr UncachedInstrs[kMaxBlockLength];
+
+
+inline u32 BlockKey(u32 addr, bool thumb)
+{
+    return addr | (thumb ? 1 : 0);
+}
+
+inline FastCacheEntry* FastCacheSlot(u32 key)
+{
+    return &FastCache[(key * 0x9E3779B1) >> (32 - kFastCacheBits)];
+}
+
+
+bool Init()
+{
+    InstrBuffer = new FetchedInstr[kInstrBufferSize];
+    PageBlocks = new std::vector<u32>[kNumCodePages];
+    FastCache = new FastCacheEntry[1 << kFastCacheBits];
+
+#ifdef JIT_ENABLED
+    NativeAvailable = ARMJIT_x64::Init();
+    if (!NativeAvailable)
+        Log(LogLevel::Warn, "JIT: failed to initialize the recompiler\n");
+#else
+    NativeAvailable = false;
+#endif
+    Native = NativeAvailable;
+
+    return true;
+}
+
+void DeInit()
+{
+#ifdef JIT_ENABLED
+    ARMJIT_x64::DeInit();
+#endif
+
+    delete[] InstrBuffer;
+    InstrBuffer = NULL;
+    delete[] PageBlocks;
+    PageBlocks = NULL;
+    delete[] FastCache;
+    FastCache = NULL;
+}
+
+void Reset()
+{
+    BlockMap.clear();
+    for (u32 i = 0; i < kNumCodePages; i++)
+        PageBlocks[i].clear();
+    memset(CodePages, 0, sizeof(CodePages));
+
+    for (u32 i = 0; i < (1 << kFastCacheBits); i++)
+    {
+        FastCache[i].Key = 0xFFFFFFFF;
+        FastCache[i].Block = NULL;
+    }
+
+    InstrBufferOffset = 0;
+
+#ifdef JIT_ENABLED
+    ARMJIT_x64::Reset();
+#endif
+}
+
+bool SetNative(bool native)
+{
+    if (native && !NativeAvailable) native = false;
+    if (native == Native) return native;
+
+    Reset();
+    Native = native;
+    return native;
+}
+
+
+bool IsARMBlockEnd(u32 instr)
+{
+    u32 cond = instr >> 28;
+    if (cond == 0xF)
+        return (instr & 0xFE000000) == 0xFA000000; // BLX_IMM
+
+    u32 rd = (instr >> 12) & 0xF;
+
+    switch ((instr >> 25) & 0x7)
+    {
+    case 0x0:
+    case 0x1:
+        // BX/BLX
+        if ((instr & 0x0FFFFFD0) == 0x012FFF10)
+            return true;
+        // MSR: can change the mode or unmask IRQs
+        if ((instr & 0x0DB00000) == 0x01200000)
+            return true;
+        // multiply: destination is in bits 16-19
+        if ((instr & 0x0F0000F0) == 0x00000090 && ((instr >> 16) & 0xF) == 15)
+            return true;
+        // LDRD into R14/R15
+        if ((instr & 0x0E1000F0) == 0x000000D0 && rd >= 14)
+            return true;
+        // anything writing to R15. also catches a few harmless cases, like STRH
+        return rd == 15;
+
+    case 0x2:
+    case 0x3:
+        // undefined
+        if ((instr & 0x02000010) == 0x02000010)
+            return true;
+        // LDR/LDRB into R15
+        return (instr & (1<<20)) && (rd == 15);
+
+    case 0x4:
+        // LDM with R15 in the list, or with the S bit
+        return (instr & (1<<20)) && (instr & ((1<<15) | (1<<22)));
+
+    case 0x5: // B/BL
+    case 0x6: // coprocessor load/store
+    case 0x7: // coprocessor ops and SWI
+        return true;
+    }
+
+    return true;
+}
+
+bool IsThumbBlockEnd(u32 instr)
+{
+    // B, BLX suffix, BL suffix
+    if ((instr & 0xE000) == 0xE000)
+        return (instr & 0xF800) != 0xF000;
+    // conditional branch, undefined and SWI
+    if ((instr & 0xF000) == 0xD000)
+        return true;
+    // hi register ops
+    if ((instr & 0xFC00) == 0x4400)
+    {
+        u32 op = (instr >> 8) & 0x3;
+        if (op == 3) return true; // BX/BLX
+        if (op == 1) return false; // CMP
+        return (instr & 0x87) == 0x87; // Rd=15
+    }
+    // POP with R15
+    if ((instr & 0xFF00) == 0xBD00)
+        return true;
+    // undefined
+    if ((instr & 0xF600) == 0xB400)
+        return false;
+    if ((instr & 0xF000) == 0xB000 && (instr & 0x0F00) != 0x0000)
+        return true;
+
+    return false;
+}
+
+
+// idle loop detection
+//
+// a block which branches back to itself, doesn't store anything and doesn't
+// carry any state from one iteration to the next (every register or flag it
+// reads is either left untouched by the loop, or recomputed before being read)
+// can only be exited by an external event: memory changing behind its back,
+// or an IRQ. when the CPU is in such a loop, it can skip ahead to the next
+// scheduled event.
+//
+// instructions are described by the registers and flags they read and write.
+
+const u32 kFlagV = 1 << 16;
+const u32 kFlagC = 1 << 17;
+const u32 kFlagZ = 1 << 18;
+const u32 kFlagN = 1 << 19;
+const u32 kFlagsNZ = kFlagN | kFlagZ;
+const u32 kFlagsNZCV = kFlagN | kFlagZ | kFlagC | kFlagV;
+
+const u32 CondFlags[16] =
+{
+    kFlagZ, kFlagZ,                     // EQ, NE
+    kFlagC, kFlagC,                     // CS, CC
+    kFlagN, kFlagN,                     // MI, PL
+    kFlagV, kFlagV,                     // VS, VC
+    kFlagC | kFlagZ, kFlagC | kFlagZ,   // HI, LS
+    kFlagN | kFlagV, kFlagN | kFlagV,   // GE, LT
+    kFlagsNZ | kFlagV, kFlagsNZ | kFlagV, // GT, LE
+    0, 0                                // AL, NV
+};
+
+bool DescribeARMInstr(u32 instr, u32* read, u32* write)
+{
+    u32 rd = (instr >> 12) & 0xF;
+    u32 rn = (instr >> 16) & 0xF;
+    u32 rm = instr & 0xF;
+
+    *read = 0;
+    *write = 0;
+
+    if ((instr & 0x0C000000) == 0x00000000)
+    {
+        if ((instr & 0x0E000090) == 0x00000090)
+        {
+            // multiply and extra load/stores. only loads are allowed
+            if ((instr & 0x60) == 0 || !(instr & (1<<20)))
+                return false;
+            if (!(instr & (1<<24)) || (instr & (1<<21)))
+                return false; // writeback
+
+            *read = (1 << rn);
+            if (!(instr & (1<<22))) *read |= (1 << rm);
+            *write = (1 << rd);
+            return rd != 15;
+        }
+        if ((instr & 0x01900000) == 0x01000000)
+            return false; // MRS/MSR/BX and co
+
+        u32 op = (instr >> 21) & 0xF;
+        bool setflags = !!(instr & (1<<20));
+        bool hasrd = (op < 0x8 || op > 0xB);
+        bool logical = (op <= 0x1) || (op == 0x8) || (op == 0x9) || (op >= 0xC);
+
+        if (op != 0xD && op != 0xF) *read |= (1 << rn);
+        if (!(instr & (1<<25)))
+        {
+            *read |= (1 << rm);
+            if (instr & (1<<4))
+                *read |= (1 << ((instr >> 8) & 0xF));
+            else if ((instr & 0xFE0) == 0x060)
+                *read |= kFlagC; // RRX
+        }
+        if (op == 0x5 || op == 0x6 || op == 0x7)
+            *read |= kFlagC; // ADC/SBC/RSC
+
+        if (hasrd)
+        {
+            if (rd == 15) return false;
+            *write |= (1 << rd);
+        }
+        if (setflags)
+        {
+            if (!logical)
+                *write |= kFlagsNZCV;
+            else
+            {
+                // the shifter may or may not change C
+                *write |= kFlagsNZ;
+                if (instr & (1<<25))
+                {
+                    if (instr & 0xF00)
+                        *write |= kFlagC;
+                }
+                else if (instr & (1<<4))
+                {
+                    // shift by register: C is left alone if the amount is zero
+                    *read |= kFlagC;
+                    *write |= kFlagC;
+                }
+                else if (instr & 0xFE0)
+                    *write |= kFlagC;
+            }
+        }
+        return true;
+    }
+
+    if ((instr & 0x0C000000) == 0x04000000)
+    {
+        // LDR/LDRB. no stores or writeback
+        if (!(instr & (1<<20))) return false;
+        if (!(instr & (1<<24)) || (instr & (1<<21))) return false;
+        if ((instr & 0x02000010) == 0x02000010) return false; // undefined
+
+        *read = (1 << rn);
+        if (instr & (1<<25)) *read |= (1 << rm);
+        *write = (1 << rd);
+        return rd != 15;
+    }
+
+    return false;
+}
+
+bool DescribeThumbInstr(u32 instr, u32* read, u32* write)
+{
+    u32 rd = instr & 0x7;
+    u32 rs = (instr >> 3) & 0x7;
+
+    *read = 0;
+    *write = 0;
+
+    switch (instr >> 12)
+    {
+    case 0x0:
+    case 0x1:
+        if ((instr & 0x1800) == 0x1800)
+        {
+            // ADD/SUB reg/imm3
+            *read = (1 << rs);
+            if (!(instr & (1<<10))) *read |= (1 << ((instr >> 6) & 0x7));
+            *write = (1 << rd) | kFlagsNZCV;
+        }
+        else
+        {
+            // shift by immediate
+            *read = (1 << rs);
+            *write = (1 << rd) | kFlagsNZ;
+            if (instr & 0x07C0 || (instr & 0x1800)) *write |= kFlagC;
+        }
+        return true;
+
+    case 0x2:
+    case 0x3:
+        {
+            // MOV/CMP/ADD/SUB imm8
+            u32 rdi = (instr >> 8) & 0x7;
+            u32 op = (instr >> 11) & 0x3;
+            if (op != 0) *read = (1 << rdi);
+            if (op != 1) *write = (1 << rdi);
+            *write |= (op == 0) ? kFlagsNZ : kFlagsNZCV;
+        }
+        return true;
+
+    case 0x4:
+        if ((instr & 0xFC00) == 0x4000)
+        {
+            // ALU ops
+            u32 op = (instr >> 6) & 0xF;
+            *read = (1 << rs);
+            if (op != 0x9 && op != 0xF) *read |= (1 << rd); // NEG, MVN
+            if (op != 0x8 && op != 0xA && op != 0xB) *write |= (1 << rd); // TST, CMP, CMN
+            switch (op)
+            {
+            case 0x2: case 0x3: case 0x4: case 0x7: // shifts
+                *read |= kFlagC;
+                *write |= kFlagsNZ | kFlagC;
+                break;
+            case 0x5: case 0x6: // ADC, SBC
+                *read |= kFlagC;
+                *write |= kFlagsNZCV;
+                break;
+            case 0x9: case 0xA: case 0xB: // NEG, CMP, CMN
+                *write |= kFlagsNZCV;
+                break;
+            default:
+                *write |= kFlagsNZ;
+                break;
+            }
+            return true;
+        }
+        if ((instr & 0xFC00) == 0x4400)
+        {
+            // hi register ops, except BX
+            u32 op = (instr >> 8) & 0x3;
+            u32 rdh = rd | ((instr >> 4) & 0x8);
+            u32 rsh = (instr >> 3) & 0xF;
+            if (op == 3 || rdh == 15) return false;
+            *read = (1 << rsh);
+            if (op != 2) *read |= (1 << rdh);
+            if (op != 1) *write = (1 << rdh);
+            else *write = kFlagsNZCV;
+            return true;
+        }
+        // LDR PC-relative
+        *write = (1 << ((instr >> 8) & 0x7));
+        return true;
+
+    case 0x5:
+        // register offset loads/stores
+        if (((instr >> 9) & 0x7) < 3) return false;
+        *read = (1 << rs) | (1 << ((instr >> 6) & 0x7));
+        *write = (1 << rd);
+        return true;
+
+    case 0x6:
+    case 0x7:
+    case 0x8:
+        // immediate offset loads/stores
+        if (!(instr & (1<<11))) return false;
+        *read = (1 << rs);
+        *write = (1 << rd);
+        return true;
+
+    case 0x9:
+        // SP-relative loads/stores
+        if (!(instr & (1<<11))) return false;
+        *read = (1 << 13);
+        *write = (1 << ((instr >> 8) & 0x7));
+        return true;
+
+    case 0xA:
+        // ADD rd, PC/SP, imm
+        if (instr & (1<<11)) *read = (1 << 13);
+        *write = (1 << ((instr >> 8) & 0x7));
+        return true;
+    }
+
+    return false;
+}
+
+bool IsIdleLoop(FetchedInstr* instrs, int num, bool thumb, u32 blockaddr)
+{
+    // the last instruction has to be a branch to the start of the block
+    FetchedInstr* last = &instrs[num - 1];
+    u32 branchflags;
+    if (thumb)
+    {
+        u32 target;
+        if ((last->Instr & 0xF000) == 0xD000 && (last->Instr & 0x0E00) != 0x0E00)
+        {
+            target = last->PC + ((s32)(s8)(last->Instr & 0xFF) << 1);
+            branchflags = CondFlags[(last->Instr >> 8) & 0xF];
+        }
+        else if ((last->Instr & 0xF800) == 0xE000)
+        {
+            target = last->PC + (((s32)(last->Instr << 21)) >> 20);
+            branchflags = 0;
+        }
+        else
+            return false;
+
+        if (target != blockaddr) return false;
+    }
+    else
+    {
+        if ((last->Instr & 0x0F000000) != 0x0A000000) return false;
+        if ((last->Instr >> 28) == 0xF) return false;
+
+        u32 target = last->PC + (((s32)(last->Instr << 8)) >> 6);
+        if (target != blockaddr) return false;
+
+        branchflags = CondFlags[last->Instr >> 28];
+    }
+
+    u32 readfirst = 0;
+    u32 written = 0;
+    for (int i = 0; i < num - 1; i++)
+    {
+        FetchedInstr* instr = &instrs[i];
+        u32 read, write;
+
+        if (thumb)
+        {
+            if (!DescribeThumbInstr(instr->Instr, &read, &write))
+                return false;
+        }
+        else
+        {
+            if (!DescribeARMInstr(instr->Instr, &read, &write))
+                return false;
+
+            // a conditional instruction may leave its destination untouched
+            u32 cond = instr->Instr >> 28;
+            if (cond != 0xE)
+            {
+                read |= CondFlags[cond] | write;
+            }
+        }
+
+        readfirst |= (read & ~written);
+        written |= write;
+    }
+    readfirst |= (branchflags & ~written);
+
+    // reading R15 is fine, it's a constant for any given instruction
+    readfirst &= ~(1 << 15);
+
+    return !(readfirst & written);
+}
+
+
+JitBlock* LookUpBlock(u32 addr, bool thumb)
+{
+    u32 key = BlockKey(addr, thumb);
+
+    FastCacheEntry* slot = FastCacheSlot(key);
+    if (slot->Key == key)
+        return slot->Block;
+
+    auto it = BlockMap.find(key);
+    if (it == BlockMap.end())
+        return NULL;
+
+    slot->Key = key;
+    slot->Block = &it->second;
+    return slot->Block;
+}
+
+bool FinishBlock(FetchedInstr* instrs, int num, bool thumb, JitBlock* block)
+{
+#ifdef JIT_ENABLED
+    if (Native)
+    {
+        block->Entry = ARMJIT_x64::CompileBlock(instrs, num, thumb);
+        block->Instrs = NULL;
+        block->NumInstrs = 0;
+        return block->Entry != NULL;
+    }
+#endif
+
+    if ((InstrBufferOffset + num) > kInstrBufferSize)
+        return false;
+
+    block->Entry = NULL;
+    block->Instrs = &InstrBuffer[InstrBufferOffset];
+    block->NumInstrs = num;
+    memcpy(block->Instrs, instrs, num * sizeof(FetchedInstr));
+    InstrBufferOffset += num;
+    return true;
+}
+
+JitBlock* CompileBlock(ARM* cpu)
+{
+    ARMv5* arm9 = (ARMv5*)cpu;
+
+    bool thumb = !!(cpu->CPSR & 0x20);
+    u32 blockaddr = cpu->R[15] - (thumb ? 2 : 4);
+
+    FetchedInstr instrs[kMaxBlockLength];
+    int num = 0;
+
+    // fetching instructions clobbers the code timings, save them
+    s32 oldcodecycles = cpu->CodeCycles;
+
+    u32 addr = blockaddr;
+    for (;;)
+    {
+        FetchedInstr* instr = &instrs[num++];
+        bool end;
+
+        if (thumb)
+        {
+            u32 word = arm9->CodeRead32(addr & ~0x3, false);
+            instr->Instr = (addr & 0x2) ? (word >> 16) : (word & 0xFFFF);
+            instr->PC = addr + 4;
+            instr->CondMask = 0xFFFF;
+            instr->Handler = ARMInterpreter::THUMBInstrTable[(instr->Instr >> 6) & 0x3FF];
+
+            // mirror the interpreter's prefetch
+            if (instr->PC & 0x2)
+                instr->CodeCycles = 0;
+            else
+            {
+                arm9->CodeRead32(instr->PC, false);
+                instr->CodeCycles = cpu->CodeCycles;
+            }
+
+            end = IsThumbBlockEnd(instr->Instr);
+            addr += 2;
+        }
+        else
+        {
+            instr->Instr = arm9->CodeRead32(addr, false);
+            instr->PC = addr + 8;
+            u32 cond = instr->Instr >> 28;
+            instr->CondMask = ARM::ConditionTable[cond];
+
+            if (cond == 0xF)
+            {
+                if ((instr->Instr & 0xFE000000) == 0xFA000000)
+                {
+                    instr->CondMask = 0xFFFF;
+                    instr->Handler = ARMInterpreter::A_BLX_IMM;
+                }
+                else
+                    instr->Handler = NULL;
+            }
+            else
+            {
+                u32 icode = ((instr->Instr >> 4) & 0xF) | ((instr->Instr >> 16) & 0xFF0);
+                instr->Handler = ARMInterpreter::ARMInstrTable[icode];
+            }
+
+            arm9->CodeRead32(instr->PC, false);
+            instr->CodeCycles = cpu->CodeCycles;
+
+            end = IsARMBlockEnd(instr->Instr);
+            addr += 4;
+        }
+
+        if (end || num == kMaxBlockLength)
+            break;
+    }
+
+    cpu->CodeCycles = oldcodecycles;
+
+    if (blockaddr >= 0x40000000)
+    {
+        // not cached, run it straight from the decoded instructions
+        // (compiling native code every time would be a waste)
+        memcpy(UncachedInstrs, instrs, num * sizeof(FetchedInstr));
+        UncachedBlock.Entry = NULL;
+        UncachedBlock.Instrs = UncachedInstrs;
+        UncachedBlock.NumInstrs = num;
+        UncachedBlock.IdleLoop = false;
+        return &UncachedBlock;
+    }
+
+    JitBlock block;
+    if (!FinishBlock(instrs, num, thumb, &block))
+    {
+        // out of space, start over
+        Log(LogLevel::Debug, "JIT: block cache full, flushing\n");
+        Reset();
+        FinishBlock(instrs, num, thumb, &block);
+    }
+
+    u32 key = BlockKey(blockaddr, thumb);
+    block.StartPage = (blockaddr & 0x3FFFFF) >> kCodePageShift;
+    block.EndPage = ((addr - 1) & 0x3FFFFF) >> kCodePageShift;
+    block.IdleLoop = IsIdleLoop(instrs, num, thumb, blockaddr);
+    JitBlock* ret = &(BlockMap[key] = block);
+
+    // the block may wrap around the end of main RAM
+    for (u32 page = block.StartPage; ; page = (page + 1) & (kNumCodePages - 1))
+    {
+        PageBlocks[page].push_back(key);
+        CodePages[page] = 1;
+        if (page == block.EndPage) break;
+    }
+
+    FastCacheEntry* slot = FastCacheSlot(key);
+    slot->Key = key;
+    slot->Block = ret;
+
+    return ret;
+}
+
+
+void InvalidateByAddr(u32 addr)
+{
+    u32 page = (addr & 0x3FFFFF) >> kCodePageShift;
+
+    // copy the list, as it is modified below
+    std::vector<u32> keys;
+    keys.swap(PageBlocks[page]);
+
+    for (u32 key : keys)
+    {
+        auto it = BlockMap.find(key);
+        if (it == BlockMap.end())
+            continue;
+
+        // remove the block from the other pages it spans
+        JitBlock& block = it->second;
+        for (u32 p = block.StartPage; ; p = (p + 1) & (kNumCodePages - 1))
+        {
+            if (p != page)
+            {
+                std::vector<u32>& list = PageBlocks[p];
+                list.erase(std::remove(list.begin(), list.end(), key), list.end());
+                CodePages[p] = !list.empty();
+            }
+            if (p == block.EndPage) break;
+        }
+
+        FastCacheEntry* slot = FastCacheSlot(key);
+        if (slot->Key == key)
+        {
+            slot->Key = 0xFFFFFFFF;
+            slot->Block = NULL;
+        }
+
+        BlockMap.erase(it);
+    }
+
+    CodePages[page] = 0;
+
+    // compiled code and decoded instructions stay around until the next flush,
+    // since the block being invalidated may be the one that is currently running
+}
+
+void InvalidateRange(u32 addr, u32 len)
+{
+    if (!len) return;
+
+    u32 start = (addr & 0x3FFFFF) >> kCodePageShift;
+    u32 end = ((addr + len - 1) & 0x3FFFFF) >> kCodePageShift;
+    for (u32 page = start; ; page = (page + 1) & (kNumCodePages - 1))
+    {
+        if (CodePages[page])
+            InvalidateByAddr(page << kCodePageShift);
+        if (page == end) break;
+    }
+}
+
+}
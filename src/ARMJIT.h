@@ -0,0 +1,89 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ARMJIT_H
+#define ARMJIT_H
+
+#include "types.h"
+#include "ARM.h"
+
+namespace ARMJIT
+{
+
+typedef void (*JitBlockEntry)(ARM* cpu);
+
+// a decoded guest instruction
+struct FetchedInstr
+{
+    u32 Instr;
+    u32 PC; // value of R15 while this instruction executes
+    s32 CodeCycles;
+    u16 CondMask; // ConditionTable entry, indexed by the CPSR flags
+    void (*Handler)(ARM* cpu); // NULL if the instruction never executes
+};
+
+struct JitBlock
+{
+    // native code, when using the recompiler
+    JitBlockEntry Entry;
+
+    // decoded instructions, when using the cached interpreter
+    FetchedInstr* Instrs;
+    u32 NumInstrs;
+
+    u32 StartPage, EndPage;
+
+    // the block is a loop on itself which can't change any state besides
+    // polling memory, see IsIdleLoop(). loops polling the timers don't
+    // count, this is checked as they run
+    bool IdleLoop;
+};
+
+// main RAM is tracked in 512-byte pages, so that data living next to code
+// doesn't cause too many needless invalidations
+const u32 kCodePageShift = 9;
+const u32 kNumCodePages = 0x400000 >> kCodePageShift;
+
+// nonzero if the given page of main RAM contains compiled code
+extern thread_local u8 CodePages[kNumCodePages];
+
+bool Init();
+void DeInit();
+void Reset();
+
+// selects between compiling blocks to native code and keeping them decoded
+// for the cached interpreter. flushes the cache if the setting changes
+// returns whether native code is used
+bool SetNative(bool native);
+
+JitBlock* LookUpBlock(u32 addr, bool thumb);
+// the returned block is only valid until the next call
+JitBlock* CompileBlock(ARM* cpu);
+
+void InvalidateByAddr(u32 addr);
+void InvalidateRange(u32 addr, u32 len);
+
+inline void CheckAndInvalidate(u32 addr)
+{
+    if (CodePages[(addr & 0x3FFFFF) >> kCodePageShift])
+        InvalidateByAddr(addr);
+}
+
+}
+
+#endif // ARMJIT_H
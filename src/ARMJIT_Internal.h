@@ -0,0 +1,41 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ARMJIT_INTERNAL_H
+#define ARMJIT_INTERNAL_H
+
+#include "types.h"
+#include "ARMJIT.h"
+
+namespace ARMJIT_x64
+{
+
+bool Init();
+void DeInit();
+void Reset();
+
+// returns NULL if there is no room left, in which case the cache has to be flushed
+ARMJIT::JitBlockEntry CompileBlock(ARMJIT::FetchedInstr* instrs, int num, bool thumb);
+
+// called from the fault handler. if the given address is an inlined guest
+// memory access, patches it into a slow path call and returns true
+bool PatchFastmemAccess(u8* rip);
+
+}
+
+#endif // ARMJIT_INTERNAL_H
@@ -0,0 +1,251 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#if defined(__linux__) && defined(__x86_64__)
+#define FASTMEM_SUPPORTED
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#ifdef FASTMEM_SUPPORTED
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "ARMJIT_Memory.h"
+#include "ARMJIT_Internal.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+// fastmem
+//
+// a 4GB region of host address space is reserved, in which main RAM is mapped
+// at every place it is mirrored in the ARM9 address space. compiled code can
+// then access guest memory with a plain host load or store, without any range
+// check or masking.
+// everything else is left inaccessible. accessing it faults, and the signal
+// handler lets the backend patch the faulting access into a call to the slow
+// path, so that it doesn't fault again.
+
+namespace ARMJIT_Memory
+{
+
+const u32 kMainRAMSize = 0x400000;
+const u32 kMainRAMMirrorEnd = 0x40000000;
+
+// extra room so that accesses crossing the end of the address space still fault
+const u64 kFastmemSize = 0x100000000ULL + 0x1000;
+
+thread_local u8* FastmemBase = NULL;
+
+#ifdef FASTMEM_SUPPORTED
+
+thread_local int MainRAMFD = -1;
+
+// the fault handler is shared by all the emulator instances. it runs on the
+// faulting thread, so it gets to see the state of the right instance
+std::mutex HandlerLock;
+int HandlerUsers = 0;
+struct sigaction OldSigsegv;
+
+void SigsegvHandler(int sig, siginfo_t* info, void* rawctx)
+{
+    ucontext_t* ctx = (ucontext_t*)rawctx;
+    u8* rip = (u8*)ctx->uc_mcontext.gregs[REG_RIP];
+
+    // the access is patched in place, execution resumes at the same address
+    if (ARMJIT_x64::PatchFastmemAccess(rip))
+        return;
+
+    // not ours
+    if (OldSigsegv.sa_flags & SA_SIGINFO)
+    {
+        OldSigsegv.sa_sigaction(sig, info, rawctx);
+        return;
+    }
+    if (OldSigsegv.sa_handler != SIG_DFL && OldSigsegv.sa_handler != SIG_IGN)
+    {
+        OldSigsegv.sa_handler(sig);
+        return;
+    }
+
+    // let the fault happen again, with the default handler this time
+    sigaction(SIGSEGV, &OldSigsegv, NULL);
+}
+
+bool InstallHandler()
+{
+    std::lock_guard<std::mutex> lock(HandlerLock);
+
+    if (HandlerUsers == 0)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = SigsegvHandler;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGSEGV, &sa, &OldSigsegv) < 0)
+            return false;
+    }
+
+    HandlerUsers++;
+    return true;
+}
+
+void RemoveHandler()
+{
+    std::lock_guard<std::mutex> lock(HandlerLock);
+
+    HandlerUsers--;
+    if (HandlerUsers == 0)
+        sigaction(SIGSEGV, &OldSigsegv, NULL);
+}
+
+u8* AllocMainRAM()
+{
+    MainRAMFD = memfd_create("pomelopad main RAM", 0);
+    if (MainRAMFD < 0 || ftruncate(MainRAMFD, kMainRAMSize) < 0)
+    {
+        Log(LogLevel::Warn, "fastmem: failed to create main RAM backing\n");
+        if (MainRAMFD >= 0) close(MainRAMFD);
+        MainRAMFD = -1;
+        return new u8[kMainRAMSize];
+    }
+
+    u8* mainram = (u8*)mmap(NULL, kMainRAMSize, PROT_READ | PROT_WRITE, MAP_SHARED, MainRAMFD, 0);
+    if (mainram == MAP_FAILED)
+    {
+        Log(LogLevel::Warn, "fastmem: failed to map main RAM\n");
+        close(MainRAMFD);
+        MainRAMFD = -1;
+        return new u8[kMainRAMSize];
+    }
+
+    void* base = mmap(NULL, kFastmemSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        Log(LogLevel::Warn, "fastmem: failed to reserve address space\n");
+        return mainram;
+    }
+
+    for (u32 addr = 0; addr < kMainRAMMirrorEnd; addr += kMainRAMSize)
+    {
+        void* mirror = mmap((u8*)base + addr, kMainRAMSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, MainRAMFD, 0);
+        if (mirror == MAP_FAILED)
+        {
+            Log(LogLevel::Warn, "fastmem: failed to map main RAM mirror at %08X\n", addr);
+            munmap(base, kFastmemSize);
+            return mainram;
+        }
+    }
+
+    if (!InstallHandler())
+    {
+        Log(LogLevel::Warn, "fastmem: failed to install fault handler\n");
+        munmap(base, kFastmemSize);
+        return mainram;
+    }
+
+    FastmemBase = (u8*)base;
+    return mainram;
+}
+
+void FreeMainRAM(u8* mem)
+{
+    if (MainRAMFD < 0)
+    {
+        delete[] mem;
+        return;
+    }
+
+    if (FastmemBase)
+    {
+        RemoveHandler();
+        munmap(FastmemBase, kFastmemSize);
+        FastmemBase = NULL;
+    }
+
+    munmap(mem, kMainRAMSize);
+    close(MainRAMFD);
+    MainRAMFD = -1;
+}
+
+bool UnshareMainRAM(u8* mem)
+{
+    // heap memory is copied on write anyway
+    if (MainRAMFD < 0) return true;
+
+    int fd = memfd_create("pomelopad main RAM", 0);
+    if (fd < 0) return false;
+    if (pwrite(fd, mem, kMainRAMSize, 0) != (ssize_t)kMainRAMSize)
+    {
+        close(fd);
+        return false;
+    }
+
+    // everything is mapped again at the same place, so compiled code and
+    // pointers into main RAM stay valid
+    if (mmap(mem, kMainRAMSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    if (FastmemBase)
+    {
+        for (u32 addr = 0; addr < kMainRAMMirrorEnd; addr += kMainRAMSize)
+        {
+            if (mmap(FastmemBase + addr, kMainRAMSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+            {
+                close(fd);
+                return false;
+            }
+        }
+    }
+
+    close(MainRAMFD);
+    MainRAMFD = fd;
+    return true;
+}
+
+#else
+
+u8* AllocMainRAM()
+{
+    return new u8[kMainRAMSize];
+}
+
+void FreeMainRAM(u8* mem)
+{
+    delete[] mem;
+}
+
+bool UnshareMainRAM(u8* mem)
+{
+    return true;
+}
+
+#endif
+
+}
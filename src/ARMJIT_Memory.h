@@ -0,0 +1,41 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ARMJIT_MEMORY_H
+#define ARMJIT_MEMORY_H
+
+#include "types.h"
+
+namespace ARMJIT_Memory
+{
+
+// base of the 4GB host region mirroring the ARM9 address space, NULL if
+// fastmem isn't supported on this platform
+extern thread_local u8* FastmemBase;
+
+// allocates main RAM, mapped into the fastmem region if possible
+u8* AllocMainRAM();
+void FreeMainRAM(u8* mem);
+
+// main RAM is shared memory when it's mapped into the fastmem region. after
+// fork(), this gives the child process its own copy of it
+bool UnshareMainRAM(u8* mem);
+
+}
+
+#endif // ARMJIT_MEMORY_H
@@ -0,0 +1,618 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <unordered_map>
+#include <vector>
+#include "WUP.h"
+#include "ARMJIT.h"
+#include "ARMJIT_Internal.h"
+#include "ARMJIT_Memory.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+// x86-64 backend
+//
+// blocks are call-threaded: for every instruction, the CPU state the
+// interpreter handler expects (R15, CurInstr, CodeCycles) is stored with
+// immediates, the condition is checked inline, and the handler is called
+// directly. this gets rid of the fetch/decode/dispatch work and the
+// indirect calls of the interpreter loop, while reusing the exact same
+// instruction semantics and timings.
+//
+// when fastmem is available, simple loads and stores are inlined. they go
+// straight to the fastmem region, and if they fault (MMIO or unmapped memory),
+// the access gets patched into a jump to an out-of-line slow path which calls
+// the regular memory handlers.
+//
+// register usage: RBX holds the ARM* for the whole block, R12 the fastmem base.
+// inlined accesses use EAX for the address, EDX for the aligned address and
+// ECX for the data.
+
+namespace ARMJIT_x64
+{
+
+using ARMJIT::FetchedInstr;
+using ARMJIT::JitBlockEntry;
+
+const u32 kCodeBufferSize = 32 * 1024 * 1024;
+
+// worst case size of the code emitted for one instruction, slow paths included
+const u32 kMaxInstrSize = 256;
+const u32 kMaxBlockOverhead = 48;
+
+thread_local u8* CodeBuffer = NULL;
+thread_local u32 CodeOffset;
+
+// member offsets within the ARM class
+thread_local s32 OffsetCycles;
+thread_local s32 OffsetCodeCycles;
+thread_local s32 OffsetR15;
+thread_local s32 OffsetCPSR;
+thread_local s32 OffsetCurInstr;
+
+// inlined memory accesses: site address -> slow path
+thread_local std::unordered_map<u8*, u8*> FastmemSites;
+
+
+bool Init()
+{
+#ifdef _WIN32
+    CodeBuffer = (u8*)VirtualAlloc(NULL, kCodeBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+    if (!CodeBuffer)
+    {
+        Log(LogLevel::Error, "JIT: failed to allocate code buffer\n");
+        return false;
+    }
+#else
+    void* mem = mmap(NULL, kCodeBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        Log(LogLevel::Error, "JIT: failed to allocate code buffer\n");
+        CodeBuffer = NULL;
+        return false;
+    }
+    CodeBuffer = (u8*)mem;
+#endif
+
+    ARM* cpu = WUP::ARM9;
+    OffsetCycles = (s32)((u8*)&cpu->Cycles - (u8*)cpu);
+    OffsetCodeCycles = (s32)((u8*)&cpu->CodeCycles - (u8*)cpu);
+    OffsetR15 = (s32)((u8*)&cpu->R[15] - (u8*)cpu);
+    OffsetCPSR = (s32)((u8*)&cpu->CPSR - (u8*)cpu);
+    OffsetCurInstr = (s32)((u8*)&cpu->CurInstr - (u8*)cpu);
+
+    CodeOffset = 0;
+    return true;
+}
+
+void DeInit()
+{
+    if (!CodeBuffer) return;
+
+#ifdef _WIN32
+    VirtualFree(CodeBuffer, 0, MEM_RELEASE);
+#else
+    munmap(CodeBuffer, kCodeBufferSize);
+#endif
+    CodeBuffer = NULL;
+}
+
+void Reset()
+{
+    CodeOffset = 0;
+    FastmemSites.clear();
+}
+
+
+thread_local u8* Code;
+
+inline void Emit8(u8 val)
+{
+    *Code++ = val;
+}
+
+inline void Emit32(u32 val)
+{
+    memcpy(Code, &val, 4);
+    Code += 4;
+}
+
+inline void Emit64(u64 val)
+{
+    memcpy(Code, &val, 8);
+    Code += 8;
+}
+
+// mov dword [rbx+offset], imm32
+void EmitStoreImm32(s32 offset, u32 val)
+{
+    Emit8(0xC7); Emit8(0x83);
+    Emit32(offset);
+    Emit32(val);
+}
+
+// add dword [rbx+offset], imm32
+void EmitAddImm32(s32 offset, u32 val)
+{
+    Emit8(0x81); Emit8(0x83);
+    Emit32(offset);
+    Emit32(val);
+}
+
+// mov rax, imm64 / call rax
+void EmitCall(void* func)
+{
+    Emit8(0x48); Emit8(0xB8);
+    Emit64((u64)func);
+    Emit8(0xFF); Emit8(0xD0);
+}
+
+// jmp/jcc rel32 to the given target
+void EmitJump(u8* target)
+{
+    Emit8(0xE9);
+    Emit32((u32)(target - (Code + 4)));
+}
+
+void PatchRel32(u8* rel, u8* target)
+{
+    u32 val = (u32)(target - (rel + 4));
+    memcpy(rel, &val, 4);
+}
+
+void EmitCallHandler(void (*handler)(ARM*))
+{
+#ifdef _WIN32
+    Emit8(0x48); Emit8(0x89); Emit8(0xD9); // mov rcx, rbx
+#else
+    Emit8(0x48); Emit8(0x89); Emit8(0xDF); // mov rdi, rbx
+#endif
+    EmitCall((void*)handler);
+}
+
+
+// simple loads and stores that can be inlined
+struct MemOp
+{
+    bool Store;
+    int Size;
+    int Rd;
+    int Rn; // -1 if the address is a constant
+    u32 Addr; // constant address
+    s32 Offset;
+    bool PreIndex;
+    bool Writeback;
+    bool Rotate; // unaligned LDR rotates the loaded word
+};
+
+bool DecodeMemOp(FetchedInstr* instr, bool thumb, MemOp* op)
+{
+    u32 ins = instr->Instr;
+
+    op->Rn = -1;
+    op->Addr = 0;
+    op->Offset = 0;
+    op->PreIndex = true;
+    op->Writeback = false;
+    op->Rotate = false;
+
+    if (thumb)
+    {
+        if ((ins & 0xE000) == 0x6000)
+        {
+            // LDR/STR/LDRB/STRB imm
+            bool byte = !!(ins & (1<<12));
+            op->Store = !(ins & (1<<11));
+            op->Size = byte ? 8 : 32;
+            op->Rd = ins & 0x7;
+            op->Rn = (ins >> 3) & 0x7;
+            op->Offset = byte ? ((ins >> 6) & 0x1F) : ((ins >> 4) & 0x7C);
+            op->Rotate = !byte && !op->Store;
+            return true;
+        }
+        if ((ins & 0xF000) == 0x8000)
+        {
+            // LDRH/STRH imm
+            op->Store = !(ins & (1<<11));
+            op->Size = 16;
+            op->Rd = ins & 0x7;
+            op->Rn = (ins >> 3) & 0x7;
+            op->Offset = (ins >> 5) & 0x3E;
+            return true;
+        }
+        if ((ins & 0xF800) == 0x4800)
+        {
+            // LDR PC-relative
+            op->Store = false;
+            op->Size = 32;
+            op->Rd = (ins >> 8) & 0x7;
+            op->Addr = (instr->PC & ~0x2) + ((ins & 0xFF) << 2);
+            return true;
+        }
+        if ((ins & 0xF000) == 0x9000)
+        {
+            // LDR/STR SP-relative
+            op->Store = !(ins & (1<<11));
+            op->Size = 32;
+            op->Rd = (ins >> 8) & 0x7;
+            op->Rn = 13;
+            op->Offset = (ins << 2) & 0x3FC;
+            return true;
+        }
+
+        return false;
+    }
+
+    // LDR/STR/LDRB/STRB with an immediate offset
+    if ((ins & 0x0E000000) != 0x04000000)
+        return false;
+
+    op->Store = !(ins & (1<<20));
+    op->Size = (ins & (1<<22)) ? 8 : 32;
+    op->Rd = (ins >> 12) & 0xF;
+    op->Rn = (ins >> 16) & 0xF;
+    op->Offset = ins & 0xFFF;
+    if (!(ins & (1<<23))) op->Offset = -op->Offset;
+    op->PreIndex = !!(ins & (1<<24));
+    // post-indexed accesses always write back
+    op->Writeback = !op->PreIndex || (ins & (1<<21));
+    op->Rotate = (op->Size == 32) && !op->Store;
+
+    // loads into R15 end the block and need the handler
+    if (!op->Store && op->Rd == 15)
+        return false;
+
+    if (op->Rn == 15)
+    {
+        if (op->Writeback) return false;
+
+        op->Rn = -1;
+        op->Addr = instr->PC + op->Offset;
+        op->Offset = 0;
+    }
+
+    return true;
+}
+
+// an out-of-line path, emitted after the block
+struct SlowPath
+{
+    int Type;
+    int Size;
+    u8* Site; // fastmem access, or rel32 to patch
+    u8* Resume;
+};
+
+enum
+{
+    SlowPath_Load = 0,
+    SlowPath_Store,
+    SlowPath_Invalidate,
+};
+
+thread_local std::vector<SlowPath> SlowPaths;
+
+void EmitMemOp(FetchedInstr* instr, MemOp* op)
+{
+    s32 rn = (s32)((u8*)&WUP::ARM9->R[op->Rn < 0 ? 0 : op->Rn] - (u8*)WUP::ARM9);
+    s32 rd = (s32)((u8*)&WUP::ARM9->R[op->Rd] - (u8*)WUP::ARM9);
+
+    // address
+    if (op->Rn < 0)
+    {
+        Emit8(0xB8); Emit32(op->Addr); // mov eax, imm32
+    }
+    else
+    {
+        Emit8(0x8B); Emit8(0x83); Emit32(rn); // mov eax, [rbx+Rn]
+        if (op->PreIndex && op->Offset)
+        {
+            Emit8(0x05); Emit32(op->Offset); // add eax, imm32
+        }
+    }
+
+    Emit8(0x89); Emit8(0xC2); // mov edx, eax
+    if (op->Size == 32)
+    {
+        Emit8(0x83); Emit8(0xE2); Emit8(0xFC); // and edx, ~3
+    }
+    else if (op->Size == 16)
+    {
+        Emit8(0x83); Emit8(0xE2); Emit8(0xFE); // and edx, ~1
+    }
+
+    if (op->Store)
+    {
+        Emit8(0x8B); Emit8(0x8B); Emit32(rd); // mov ecx, [rbx+Rd]
+    }
+
+    // the access itself. always 5 bytes, so it can be patched into a jmp
+    SlowPath slow;
+    slow.Type = op->Store ? SlowPath_Store : SlowPath_Load;
+    slow.Size = op->Size;
+    slow.Site = Code;
+    if (op->Store)
+    {
+        switch (op->Size)
+        {
+        case 8: Emit8(0x41); Emit8(0x88); Emit8(0x0C); Emit8(0x14); Emit8(0x90); break; // mov [r12+rdx], cl / nop
+        case 16: Emit8(0x66); Emit8(0x41); Emit8(0x89); Emit8(0x0C); Emit8(0x14); break; // mov [r12+rdx], cx
+        case 32: Emit8(0x41); Emit8(0x89); Emit8(0x0C); Emit8(0x14); Emit8(0x90); break; // mov [r12+rdx], ecx / nop
+        }
+
+        // mark the page dirty for savestates
+        Emit8(0x89); Emit8(0xD1); // mov ecx, edx
+        Emit8(0x81); Emit8(0xE1); Emit32(0x3FFFFF); // and ecx, 0x3FFFFF
+        Emit8(0xC1); Emit8(0xE9); Emit8(WUP::kDirtyPageShift); // shr ecx, shift
+        Emit8(0x49); Emit8(0xB9); Emit64((u64)&WUP::MainRAMDirty[0]); // mov r9, imm64
+        Emit8(0x41); Emit8(0xC6); Emit8(0x04); Emit8(0x09); Emit8(WUP::Dirty_All); // mov byte [r9+rcx], 0xFF
+
+        // invalidate compiled code if needed
+        Emit8(0x89); Emit8(0xD1); // mov ecx, edx
+        Emit8(0x81); Emit8(0xE1); Emit32(0x3FFFFF); // and ecx, 0x3FFFFF
+        Emit8(0xC1); Emit8(0xE9); Emit8(ARMJIT::kCodePageShift); // shr ecx, shift
+        Emit8(0x49); Emit8(0xB9); Emit64((u64)&ARMJIT::CodePages[0]); // mov r9, imm64
+        Emit8(0x41); Emit8(0x80); Emit8(0x3C); Emit8(0x09); Emit8(0x00); // cmp byte [r9+rcx], 0
+        Emit8(0x0F); Emit8(0x85); // jne invalidate
+        SlowPath inval;
+        inval.Type = SlowPath_Invalidate;
+        inval.Size = op->Size;
+        inval.Site = Code;
+        Emit32(0);
+        inval.Resume = Code;
+        SlowPaths.push_back(inval);
+
+        // the slow path already takes care of invalidation
+        slow.Resume = Code;
+    }
+    else
+    {
+        switch (op->Size)
+        {
+        case 8: Emit8(0x41); Emit8(0x0F); Emit8(0xB6); Emit8(0x0C); Emit8(0x14); break; // movzx ecx, byte [r12+rdx]
+        case 16: Emit8(0x41); Emit8(0x0F); Emit8(0xB7); Emit8(0x0C); Emit8(0x14); break; // movzx ecx, word [r12+rdx]
+        case 32: Emit8(0x41); Emit8(0x8B); Emit8(0x0C); Emit8(0x14); Emit8(0x90); break; // mov ecx, [r12+rdx] / nop
+        }
+        slow.Resume = Code;
+
+        if (op->Rotate && (op->Rn >= 0 || (op->Addr & 0x3)))
+        {
+            Emit8(0x41); Emit8(0x89); Emit8(0xC8); // mov r8d, ecx
+            Emit8(0x89); Emit8(0xC1); // mov ecx, eax
+            Emit8(0x83); Emit8(0xE1); Emit8(0x03); // and ecx, 3
+            Emit8(0xC1); Emit8(0xE1); Emit8(0x03); // shl ecx, 3
+            Emit8(0x41); Emit8(0xD3); Emit8(0xC8); // ror r8d, cl
+            Emit8(0x44); Emit8(0x89); Emit8(0xC1); // mov ecx, r8d
+        }
+    }
+    SlowPaths.push_back(slow);
+
+    // base writeback happens before the loaded value is written, like in the interpreter
+    if (op->Writeback)
+    {
+        if (!op->PreIndex && op->Offset)
+        {
+            Emit8(0x05); Emit32(op->Offset); // add eax, imm32
+        }
+        Emit8(0x89); Emit8(0x83); Emit32(rn); // mov [rbx+Rn], eax
+    }
+
+    if (!op->Store)
+    {
+        Emit8(0x89); Emit8(0x8B); Emit32(rd); // mov [rbx+Rd], ecx
+    }
+
+    // same as AddCycles_CD/CDI, data accesses take one cycle
+    s32 numC = instr->CodeCycles;
+    s32 numD = 1;
+    s32 cycles = std::max(numC + numD - 6, std::max(numC, numD));
+    EmitAddImm32(OffsetCycles, cycles);
+}
+
+void EmitSlowPath(SlowPath* slow)
+{
+    u8* start = Code;
+
+    Emit8(0x89); Emit8(0x44); Emit8(0x24); Emit8(0x20); // mov [rsp+32], eax
+
+    switch (slow->Type)
+    {
+    case SlowPath_Load:
+#ifdef _WIN32
+        Emit8(0x89); Emit8(0xD1); // mov ecx, edx
+#else
+        Emit8(0x89); Emit8(0xD7); // mov edi, edx
+#endif
+        switch (slow->Size)
+        {
+        case 8:
+            EmitCall((void*)WUP::ARM9Read8);
+            Emit8(0x0F); Emit8(0xB6); Emit8(0xC8); // movzx ecx, al
+            break;
+        case 16:
+            EmitCall((void*)WUP::ARM9Read16);
+            Emit8(0x0F); Emit8(0xB7); Emit8(0xC8); // movzx ecx, ax
+            break;
+        case 32:
+            EmitCall((void*)WUP::ARM9Read32);
+            Emit8(0x89); Emit8(0xC1); // mov ecx, eax
+            break;
+        }
+        break;
+
+    case SlowPath_Store:
+#ifdef _WIN32
+        Emit8(0x87); Emit8(0xCA); // xchg ecx, edx
+#else
+        Emit8(0x89); Emit8(0xD7); // mov edi, edx
+        Emit8(0x89); Emit8(0xCE); // mov esi, ecx
+#endif
+        switch (slow->Size)
+        {
+        case 8: EmitCall((void*)WUP::ARM9Write8); break;
+        case 16: EmitCall((void*)WUP::ARM9Write16); break;
+        case 32: EmitCall((void*)WUP::ARM9Write32); break;
+        }
+        break;
+
+    case SlowPath_Invalidate:
+#ifdef _WIN32
+        Emit8(0x89); Emit8(0xD1); // mov ecx, edx
+#else
+        Emit8(0x89); Emit8(0xD7); // mov edi, edx
+#endif
+        EmitCall((void*)ARMJIT::InvalidateByAddr);
+        break;
+    }
+
+    Emit8(0x8B); Emit8(0x44); Emit8(0x24); Emit8(0x20); // mov eax, [rsp+32]
+    EmitJump(slow->Resume);
+
+    if (slow->Type == SlowPath_Invalidate)
+        PatchRel32(slow->Site, start);
+    else
+        FastmemSites[slow->Site] = start;
+}
+
+void EmitInstrBody(FetchedInstr* instr, bool thumb)
+{
+    MemOp op;
+    if (ARMJIT_Memory::FastmemBase && DecodeMemOp(instr, thumb, &op))
+        EmitMemOp(instr, &op);
+    else
+        EmitCallHandler(instr->Handler);
+}
+
+bool PatchFastmemAccess(u8* rip)
+{
+    auto it = FastmemSites.find(rip);
+    if (it == FastmemSites.end())
+        return false;
+
+    // from now on, this access always takes the slow path
+    u8* oldcode = Code;
+    Code = rip;
+    EmitJump(it->second);
+    Code = oldcode;
+
+    FastmemSites.erase(it);
+    return true;
+}
+
+JitBlockEntry CompileBlock(FetchedInstr* instrs, int num, bool thumb)
+{
+    if (!CodeBuffer) return NULL;
+    if ((CodeOffset + kMaxBlockOverhead + (num * kMaxInstrSize)) > kCodeBufferSize)
+        return NULL;
+
+    u8* start = &CodeBuffer[CodeOffset];
+    Code = start;
+
+    SlowPaths.clear();
+
+    // prologue
+    // keeps the stack 16-byte aligned and leaves the shadow space needed on Windows,
+    // plus a slot for saving EAX in slow paths
+    Emit8(0x53); // push rbx
+    Emit8(0x41); Emit8(0x54); // push r12
+    Emit8(0x48); Emit8(0x83); Emit8(0xEC); Emit8(0x28); // sub rsp, 40
+#ifdef _WIN32
+    Emit8(0x48); Emit8(0x89); Emit8(0xCB); // mov rbx, rcx
+#else
+    Emit8(0x48); Emit8(0x89); Emit8(0xFB); // mov rbx, rdi
+#endif
+    Emit8(0x49); Emit8(0xBC); Emit64((u64)ARMJIT_Memory::FastmemBase); // mov r12, imm64
+
+    for (int i = 0; i < num; i++)
+    {
+        FetchedInstr* instr = &instrs[i];
+
+        EmitStoreImm32(OffsetR15, instr->PC);
+        EmitStoreImm32(OffsetCodeCycles, instr->CodeCycles);
+
+        if (!instr->Handler)
+        {
+            // never executed, only takes the code cycles
+            EmitAddImm32(OffsetCycles, instr->CodeCycles);
+            continue;
+        }
+
+        EmitStoreImm32(OffsetCurInstr, instr->Instr);
+
+        if (instr->CondMask == 0xFFFF)
+        {
+            EmitInstrBody(instr, thumb);
+            continue;
+        }
+
+        // mov eax, [rbx+CPSR]
+        Emit8(0x8B); Emit8(0x83);
+        Emit32(OffsetCPSR);
+        // shr eax, 28
+        Emit8(0xC1); Emit8(0xE8); Emit8(0x1C);
+        // mov ecx, condmask
+        Emit8(0xB9);
+        Emit32(instr->CondMask);
+        // bt ecx, eax
+        Emit8(0x0F); Emit8(0xA3); Emit8(0xC1);
+
+        // jnc fail
+        Emit8(0x0F); Emit8(0x83);
+        u8* failjump = Code;
+        Emit32(0);
+
+        EmitInstrBody(instr, thumb);
+
+        // jmp next
+        Emit8(0xE9);
+        u8* nextjump = Code;
+        Emit32(0);
+
+        PatchRel32(failjump, Code);
+        EmitAddImm32(OffsetCycles, instr->CodeCycles);
+
+        PatchRel32(nextjump, Code);
+    }
+
+    // epilogue
+    Emit8(0x48); Emit8(0x83); Emit8(0xC4); Emit8(0x28); // add rsp, 40
+    Emit8(0x41); Emit8(0x5C); // pop r12
+    Emit8(0x5B); // pop rbx
+    Emit8(0xC3); // ret
+
+    for (SlowPath& slow : SlowPaths)
+        EmitSlowPath(&slow);
+
+    CodeOffset = (u32)(Code - CodeBuffer);
+    // keep blocks aligned
+    CodeOffset = (CodeOffset + 15) & ~15;
+
+    return (JitBlockEntry)start;
+}
+
+}
@@ -55,19 +55,19 @@ namespace Audio
 // F00054C4 = 111
 // rest is 0
 
-u32 Unk00, Unk04;
-u32 OutBufStart, OutBufEnd;
-u32 OutBufNew, OutBufPos;
-u32 Unk18, Unk1C;
-u32 Unk20;
-u32 EndAdvance;
-u32 IRQEnable;
-u32 IRQStatus;
-u32 Unk34;
-u32 Unk44;
+thread_local u32 Unk00, Unk04;
+thread_local u32 OutBufStart, OutBufEnd;
+thread_local u32 OutBufNew, OutBufPos;
+thread_local u32 Unk18, Unk1C;
+thread_local u32 Unk20;
+thread_local u32 EndAdvance;
+thread_local u32 IRQEnable;
+thread_local u32 IRQStatus;
+thread_local u32 Unk34;
+thread_local u32 Unk44;
 
-u32 UnkA0, UnkA4, UnkA8;
-bool playing;
+thread_local u32 UnkA0, UnkA4, UnkA8;
+thread_local bool playing;
 
 
 bool Init()
@@ -103,6 +103,31 @@ void Reset()
     playing = false;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("AUD.");
+
+    file->Var32(&Unk00);
+    file->Var32(&Unk04);
+    file->Var32(&OutBufStart);
+    file->Var32(&OutBufEnd);
+    file->Var32(&OutBufNew);
+    file->Var32(&OutBufPos);
+    file->Var32(&Unk18);
+    file->Var32(&Unk1C);
+    file->Var32(&Unk20);
+    file->Var32(&EndAdvance);
+    file->Var32(&IRQEnable);
+    file->Var32(&IRQStatus);
+    file->Var32(&Unk34);
+    file->Var32(&Unk44);
+
+    file->Var32(&UnkA0);
+    file->Var32(&UnkA4);
+    file->Var32(&UnkA8);
+    file->Bool32(&playing);
+}
+
 
 void SetIRQ(int irq)
 {
@@ -20,6 +20,7 @@
 #define AUDIO_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace Audio
 {
@@ -27,6 +28,7 @@ namespace Audio
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void framehack();
 
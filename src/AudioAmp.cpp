@@ -28,8 +28,8 @@ using Platform::LogLevel;
 namespace AudioAmp
 {
 
-u8 RegAddr;
-bool GotAddr;
+thread_local u8 RegAddr;
+thread_local bool GotAddr;
 
 
 bool Init()
@@ -47,6 +47,14 @@ void Reset()
     GotAddr = false;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("AAMP");
+
+    file->Var8(&RegAddr);
+    file->Bool32(&GotAddr);
+}
+
 
 void Start()
 {
@@ -20,6 +20,7 @@
 #define AUDIOAMP_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace AudioAmp
 {
@@ -27,6 +28,7 @@ namespace AudioAmp
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void Start();
 void Stop();
@@ -20,6 +20,7 @@
 #include <string.h>
 #include "WUP.h"
 #include "ARM.h"
+#include "ARMJIT.h"
 #include "Platform.h"
 
 using Platform::Log;
@@ -54,12 +55,12 @@ void ARMv5::CP15Reset()
 }
 
 
-void ARMv5::UpdateRegionTimings(u32 addrstart, u32 addrend)
+void ARMv5::UpdateRegionTimings(u32 pagestart, u32 pageend)
 {
-    for (u32 i = addrstart; i < addrend; i++)
+    for (u32 i = pagestart; i < pageend; i++)
     {
         //u8 pu = PU_Map[i];
-        u8* bustimings = WUP::ARM9MemTimings[i >> 2];
+        const u8* bustimings = WUP::ARM9Timings[WUP::ARM9TimingMap[i]].CPU;
 
         /*if (pu & 0x40)
         {
@@ -158,8 +159,8 @@ void ARMv5::ICacheLookup(u32 addr)
     ICacheTags[line] = tag;
 
     // ouch :/
-    //printf("cache miss %08X: %d/%d\n", addr, NDS::ARM9MemTimings[addr >> 14][2], NDS::ARM9MemTimings[addr >> 14][3]);
-    CodeCycles = (WUP::ARM9MemTimings[addr >> 14][2] + (WUP::ARM9MemTimings[addr >> 14][3] * 7));
+    const WUP::RegionTimings& timings = WUP::GetARM9Timings(addr);
+    CodeCycles = (timings.CPU[2] + (timings.CPU[3] * 7));
     CurICacheLine = ptr;
 }
 
@@ -332,7 +333,8 @@ u32 ARMv5::CodeRead32(u32 addr, bool branch)
     }*/
     CodeCycles = 1;
 
-    //if (CodeMem.Mem) return *(u32*)&CodeMem.Mem[addr & CodeMem.Mask];
+    addr &= ~0x3;
+    if (CodeMem.Mem) return *(u32*)&CodeMem.Mem[addr & CodeMem.Mask];
 
     return WUP::ARM9Read32(addr);
 }
@@ -342,8 +344,12 @@ void ARMv5::DataRead8(u32 addr, u32* val)
 {
     DataRegion = addr;
 
-    *val = WUP::ARM9Read8(addr);
-    DataCycles = 1;//MemTimings[addr >> 12][1];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+        *val = *(u8*)&page[addr & WUP::kPageMask];
+    else
+        *val = WUP::ARM9Read8(addr);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][1];
 }
 
 void ARMv5::DataRead16(u32 addr, u32* val)
@@ -352,8 +358,12 @@ void ARMv5::DataRead16(u32 addr, u32* val)
 
     addr &= ~1;
 
-    *val = WUP::ARM9Read16(addr);
-    DataCycles = 1;//MemTimings[addr >> 12][1];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+        *val = *(u16*)&page[addr & WUP::kPageMask];
+    else
+        *val = WUP::ARM9Read16(addr);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][1];
 }
 
 void ARMv5::DataRead32(u32 addr, u32* val)
@@ -362,24 +372,40 @@ void ARMv5::DataRead32(u32 addr, u32* val)
 
     addr &= ~3;
 
-    *val = WUP::ARM9Read32(addr);
-    DataCycles = 1;//MemTimings[addr >> 12][2];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+        *val = *(u32*)&page[addr & WUP::kPageMask];
+    else
+        *val = WUP::ARM9Read32(addr);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][2];
 }
 
 void ARMv5::DataRead32S(u32 addr, u32* val)
 {
     addr &= ~3;
 
-    *val = WUP::ARM9Read32(addr);
-    DataCycles += 1;//MemTimings[addr >> 12][3];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+        *val = *(u32*)&page[addr & WUP::kPageMask];
+    else
+        *val = WUP::ARM9Read32(addr);
+    DataCycles += 1;//MemTimings[addr >> WUP::kPageShift][3];
 }
 
 void ARMv5::DataWrite8(u32 addr, u8 val)
 {
     DataRegion = addr;
 
-    WUP::ARM9Write8(addr, val);
-    DataCycles = 1;//MemTimings[addr >> 12][1];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+    {
+        *(u8*)&page[addr & WUP::kPageMask] = val;
+        WUP::MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
+    }
+    else
+        WUP::ARM9Write8(addr, val);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][1];
 }
 
 void ARMv5::DataWrite16(u32 addr, u16 val)
@@ -388,8 +414,16 @@ void ARMv5::DataWrite16(u32 addr, u16 val)
 
     addr &= ~1;
 
-    WUP::ARM9Write16(addr, val);
-    DataCycles = 1;//MemTimings[addr >> 12][1];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+    {
+        *(u16*)&page[addr & WUP::kPageMask] = val;
+        WUP::MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
+    }
+    else
+        WUP::ARM9Write16(addr, val);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][1];
 }
 
 void ARMv5::DataWrite32(u32 addr, u32 val)
@@ -398,16 +432,32 @@ void ARMv5::DataWrite32(u32 addr, u32 val)
 
     addr &= ~3;
 
-    WUP::ARM9Write32(addr, val);
-    DataCycles = 1;//MemTimings[addr >> 12][2];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+    {
+        *(u32*)&page[addr & WUP::kPageMask] = val;
+        WUP::MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
+    }
+    else
+        WUP::ARM9Write32(addr, val);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][2];
 }
 
 void ARMv5::DataWrite32S(u32 addr, u32 val)
 {
     addr &= ~3;
 
-    WUP::ARM9Write32(addr, val);
-    DataCycles = 1;//MemTimings[addr >> 12][3];
+    u8* page = WUP::ARM9PageMap[addr >> WUP::kPageShift];
+    if (page)
+    {
+        *(u32*)&page[addr & WUP::kPageMask] = val;
+        WUP::MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
+    }
+    else
+        WUP::ARM9Write32(addr, val);
+    DataCycles = 1;//MemTimings[addr >> WUP::kPageShift][3];
 }
 
 void ARMv5::GetCodeMemRegion(u32 addr, WUP::MemRegion* region)
@@ -20,6 +20,7 @@
 #define CAMERA_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace Camera
 {
@@ -27,6 +28,7 @@ namespace Camera
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void Start();
 void Stop();
@@ -18,13 +18,19 @@
 
 #include <stdio.h>
 #include <string.h>
+
+#include <algorithm>
+
 #include "WUP.h"
 #include "DMA.h"
+#include "DMA_Fill.h"
 #include "SPI.h"
 #include "Platform.h"
+#include "ARMJIT.h"
 
 using Platform::Log;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 namespace DMA
 {
@@ -48,6 +54,16 @@ struct sSPDMA
         MemAddr = 0;
     }
 
+    void DoSavestate(Savestate* file)
+    {
+        file->Var32(&Start);
+        file->Var32(&Cnt);
+        file->Var32(&Unk08);
+        file->Var32(&Unk0C);
+        file->Var32(&Length);
+        file->Var32(&MemAddr);
+    }
+
     /*void StartTransfer()
     {
         // TODO make it not instant!!
@@ -77,7 +93,7 @@ struct sSPDMA
         if (Cnt & (1<<0))
         {
             // write
-            printf("SPDMA: [%08X]->[%s] len=%05X\n", MemAddr, devname, Length);
+            Log(LogChannel::DMA, LogLevel::Debug, "SPDMA: [%08X]->[%s] len=%05X\n", MemAddr, devname, Length);
 
             if (!fnstart(true)) return;
             for (;;)
@@ -92,7 +108,7 @@ struct sSPDMA
         else
         {
             // read
-            printf("SPDMA: [%s]->[%08X] len=%05X\n", devname, MemAddr, Length);
+            Log(LogChannel::DMA, LogLevel::Debug, "SPDMA: [%s]->[%08X] len=%05X\n", devname, MemAddr, Length);
 
             if (!fnstart(false)) return;
             for (;;)
@@ -163,6 +179,8 @@ struct sSPDMA
             for (u32 i = 0; i < maxlength; i++)
             {
                 WUP::MainRAM[MemAddr] = fnread();
+                WUP::MarkRAMDirty(MemAddr);
+                ARMJIT::CheckAndInvalidate(MemAddr);
                 MemAddr = (MemAddr + 1) & 0x3FFFFF;
                 Length = (Length - 1) & 0xFFFFF;
                 if (Length == 0xFFFFF) break;
@@ -241,6 +259,69 @@ struct sGPDMA
         Fill2 = 0;
     }
 
+    void DoSavestate(Savestate* file)
+    {
+        file->Var32(&Start);
+        file->Var32(&Cnt);
+        file->Var32(&ChunkSize);
+        file->Var32(&SrcStride);
+        file->Var32(&DstStride);
+        file->Var32(&Length);
+        file->Var32(&SrcAddr);
+        file->Var32(&DstAddr);
+        file->Var16(&Fill1);
+        file->Var16(&Fill2);
+    }
+
+    void MaskedFillByte(u32 len, int srcinc)
+    {
+        u8 srcdata = WUP::MainRAM[SrcAddr];
+        SrcAddr = (SrcAddr + srcinc) & 0x3FFFFF;
+
+        for (u32 i = 0; i < len; i++)
+        {
+            if (srcdata & 0x80)
+                WUP::MainRAM[DstAddr] = Fill1 & 0xFF;
+            else if (!(Cnt & (1<<8)))
+                WUP::MainRAM[DstAddr] = Fill2 & 0xFF;
+            WUP::MarkRAMDirty(DstAddr);
+            ARMJIT::CheckAndInvalidate(DstAddr);
+
+            srcdata <<= 1;
+            DstAddr = (DstAddr + 1) & 0x3FFFFF;
+        }
+    }
+
+    void CopySpan(u32 len, int srcinc)
+    {
+        u8* dst = &WUP::MainRAM[DstAddr];
+        u8* src = &WUP::MainRAM[SrcAddr];
+
+        if (srcinc > 0)
+        {
+            // when the destination starts inside the source, the bytes
+            // copied first get copied again, which memmove wouldn't do
+            if (dst > src && dst < (src + len))
+            {
+                for (u32 i = 0; i < len; i++)
+                    dst[i] = src[i];
+            }
+            else
+                memmove(dst, src, len);
+        }
+        else
+        {
+            for (u32 i = 0; i < len; i++)
+                dst[i] = *(src - i);
+        }
+
+        WUP::MarkRAMDirtyRange(DstAddr, len);
+        ARMJIT::InvalidateRange(DstAddr, len);
+
+        SrcAddr = (SrcAddr + (len * srcinc)) & 0x3FFFFF;
+        DstAddr = (DstAddr + len) & 0x3FFFFF;
+    }
+
     void StartTransfer()
     {
         if (Cnt & 0xFFFFF803)
@@ -266,12 +347,22 @@ struct sGPDMA
             {
                 u32 nextdst = DstAddr + (DstStride * dstinc);
 
-                for (u32 i = 0; i < chunk; i++)
+                // fill the chunk in spans that don't wrap around main RAM
+                u32 left = std::min(chunk, Length + 1);
+                Length = (Length - left) & 0xFFFFFF;
+
+                u32 pos = 0;
+                while (left)
                 {
-                    WUP::MainRAM[DstAddr] = fill[i & 1];
-                    DstAddr = (DstAddr + dstinc) & 0x3FFFFF;
-                    Length = (Length - 1) & 0xFFFFFF;
-                    if (Length == 0xFFFFFF) break;
+                    u32 len = std::min(left, 0x400000 - DstAddr);
+
+                    FillSpan(&WUP::MainRAM[DstAddr], len, fill[pos & 1], fill[(pos + 1) & 1]);
+                    WUP::MarkRAMDirtyRange(DstAddr, len);
+                    ARMJIT::InvalidateRange(DstAddr, len);
+
+                    DstAddr = (DstAddr + len) & 0x3FFFFF;
+                    pos += len;
+                    left -= len;
                 }
 
                 if (Length == 0xFFFFFF)
@@ -317,30 +408,36 @@ struct sGPDMA
             {
                 u32 nextsrc = SrcAddr + ((DstStride >> 3) * srcinc);
                 u32 nextdst = DstAddr + (DstStride * dstinc);
-                int nbits = 0;
-                u8 srcdata = 0;
 
-                for (u32 i = 0; i < chunk; i++)
+                // expand the chunk in spans that start on a source byte and
+                // don't wrap around main RAM
+                u32 left = std::min(chunk, Length + 1);
+                Length = (Length - left) & 0xFFFFFF;
+
+                while (left)
                 {
-                    if (nbits == 0)
+                    u32 srcleft = (srcinc > 0) ? (0x400000 - SrcAddr) : (SrcAddr + 1);
+                    u32 len = std::min(left, std::min(0x400000 - DstAddr, srcleft * 8));
+                    if (len < left)
                     {
-                        // load source data if needed
-                        srcdata = WUP::MainRAM[SrcAddr];
-                        nbits = 8;
-                        SrcAddr = (SrcAddr + srcinc) & 0x3FFFFF;
+                        len &= ~7;
+                        if (len == 0)
+                        {
+                            // the destination wraps within this source byte
+                            MaskedFillByte(std::min(left, 8u), srcinc);
+                            left -= std::min(left, 8u);
+                            continue;
+                        }
                     }
 
-                    if (srcdata & 0x80)
-                        WUP::MainRAM[DstAddr] = fill[0];
-                    else if (!(Cnt & (1<<8)))
-                        WUP::MainRAM[DstAddr] = fill[1];
-
-                    srcdata <<= 1;
-                    nbits--;
+                    MaskedFillSpan(&WUP::MainRAM[DstAddr], &WUP::MainRAM[SrcAddr], srcinc, len,
+                                   fill[0], fill[1], Cnt & (1<<8));
+                    WUP::MarkRAMDirtyRange(DstAddr, len);
+                    ARMJIT::InvalidateRange(DstAddr, len);
 
-                    DstAddr = (DstAddr + dstinc) & 0x3FFFFF;
-                    Length = (Length - 1) & 0xFFFFFF;
-                    if (Length == 0xFFFFFF) break;
+                    SrcAddr = (SrcAddr + (((len + 7) >> 3) * srcinc)) & 0x3FFFFF;
+                    DstAddr = (DstAddr + len) & 0x3FFFFF;
+                    left -= len;
                 }
 
                 if (Length == 0xFFFFFF)
@@ -380,13 +477,20 @@ struct sGPDMA
                 u32 nextsrc = SrcAddr + (SrcStride * srcinc);
                 u32 nextdst = DstAddr + (DstStride * dstinc);
 
-                for (u32 i = 0; i < chunk; i++)
+                // copy the chunk in spans that don't wrap around main RAM
+                u32 left = std::min(chunk, Length + 1);
+                Length = (Length - left) & 0xFFFFFF;
+
+                while (left)
                 {
-                    WUP::MainRAM[DstAddr] = WUP::MainRAM[SrcAddr];
-                    SrcAddr = (SrcAddr + srcinc) & 0x3FFFFF;
-                    DstAddr = (DstAddr + dstinc) & 0x3FFFFF;
-                    Length = (Length - 1) & 0xFFFFFF;
-                    if (Length == 0xFFFFFF) break;
+                    u32 len = std::min(left, 0x400000 - DstAddr);
+                    if (srcinc > 0)
+                        len = std::min(len, 0x400000 - SrcAddr);
+                    else
+                        len = std::min(len, SrcAddr + 1);
+
+                    CopySpan(len, srcinc);
+                    left -= len;
                 }
 
                 if (Length == 0xFFFFFF)
@@ -450,9 +554,9 @@ struct sGPDMA
     }
 };
 
-u32 Cnt;
-sSPDMA SPDMA[2];
-sGPDMA GPDMA[3];
+thread_local u32 Cnt;
+thread_local sSPDMA SPDMA[2];
+thread_local sGPDMA GPDMA[3];
 
 
 bool Init()
@@ -480,6 +584,19 @@ void Reset()
     GPDMA[2].Reset();
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("DMA.");
+
+    file->Var32(&Cnt);
+
+    SPDMA[0].DoSavestate(file);
+    SPDMA[1].DoSavestate(file);
+    GPDMA[0].DoSavestate(file);
+    GPDMA[1].DoSavestate(file);
+    GPDMA[2].DoSavestate(file);
+}
+
 
 void CheckSPDMA(u32 device, bool write, u32 maxlength)
 {
@@ -20,6 +20,7 @@
 #define DMA_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace DMA
 {
@@ -27,6 +28,7 @@ namespace DMA
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void CheckSPDMA(u32 device, bool write, u32 maxlength);
 
@@ -0,0 +1,203 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "DMA_Fill.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FILL_X86
+#include <immintrin.h>
+#endif
+
+namespace DMA
+{
+
+void FillScalar(u8* dst, u32 len, u8 fill0, u8 fill1)
+{
+    if (fill0 == fill1)
+    {
+        memset(dst, fill0, len);
+        return;
+    }
+
+    for (u32 i = 0; i < len; i++)
+        dst[i] = (i & 1) ? fill1 : fill0;
+}
+
+void MaskedFillScalar(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent)
+{
+    while (len)
+    {
+        u8 bits = *mask;
+        mask += maskinc;
+
+        u32 n = std::min(len, 8u);
+        for (u32 i = 0; i < n; i++)
+        {
+            if (bits & 0x80)
+                dst[i] = fill0;
+            else if (!transparent)
+                dst[i] = fill1;
+            bits <<= 1;
+        }
+
+        dst += n;
+        len -= n;
+    }
+}
+
+#ifdef FILL_X86
+
+// spreads a mask byte over 8 bytes, each one then gets tested against its bit
+const u64 kSpread = 0x0101010101010101ULL;
+#define MASK_BITS 1, 2, 4, 8, 16, 32, 64, (char)0x80
+
+__attribute__((target("sse2")))
+void FillSSE2(u8* dst, u32 len, u8 fill0, u8 fill1)
+{
+    __m128i pattern = _mm_set1_epi16((short)(fill0 | (fill1 << 8)));
+
+    u32 i = 0;
+    for (; (i + 16) <= len; i += 16)
+        _mm_storeu_si128((__m128i*)&dst[i], pattern);
+
+    // i is even, so the pattern lines up
+    FillScalar(&dst[i], len - i, fill0, fill1);
+}
+
+__attribute__((target("sse2")))
+void MaskedFillSSE2(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent)
+{
+    const __m128i bits = _mm_set_epi8(MASK_BITS, MASK_BITS);
+    __m128i set = _mm_set1_epi8((char)fill0);
+    __m128i clear = _mm_set1_epi8((char)fill1);
+
+    // 16 bytes out of two mask bytes
+    for (; len >= 16; len -= 16)
+    {
+        __m128i m = _mm_set_epi64x((s64)(mask[maskinc] * kSpread), (s64)(mask[0] * kSpread));
+        __m128i sel = _mm_cmpeq_epi8(_mm_and_si128(m, bits), bits);
+        if (transparent)
+            clear = _mm_loadu_si128((__m128i*)dst);
+
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(sel, set), _mm_andnot_si128(sel, clear)));
+
+        mask += maskinc * 2;
+        dst += 16;
+    }
+
+    MaskedFillScalar(dst, mask, maskinc, len, fill0, fill1, transparent);
+}
+
+__attribute__((target("avx2")))
+void FillAVX2(u8* dst, u32 len, u8 fill0, u8 fill1)
+{
+    __m256i pattern = _mm256_set1_epi16((short)(fill0 | (fill1 << 8)));
+
+    u32 i = 0;
+    for (; (i + 32) <= len; i += 32)
+        _mm256_storeu_si256((__m256i*)&dst[i], pattern);
+
+    FillScalar(&dst[i], len - i, fill0, fill1);
+}
+
+__attribute__((target("avx2")))
+void MaskedFillAVX2(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent)
+{
+    const __m256i bits = _mm256_set_epi8(MASK_BITS, MASK_BITS, MASK_BITS, MASK_BITS);
+    __m256i set = _mm256_set1_epi8((char)fill0);
+    __m256i clear = _mm256_set1_epi8((char)fill1);
+
+    // 32 bytes out of four mask bytes
+    for (; len >= 32; len -= 32)
+    {
+        __m256i m = _mm256_set_epi64x((s64)(mask[maskinc * 3] * kSpread), (s64)(mask[maskinc * 2] * kSpread),
+                                      (s64)(mask[maskinc] * kSpread), (s64)(mask[0] * kSpread));
+        __m256i sel = _mm256_cmpeq_epi8(_mm256_and_si256(m, bits), bits);
+        if (transparent)
+            clear = _mm256_loadu_si256((__m256i*)dst);
+
+        _mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(clear, set, sel));
+
+        mask += maskinc * 4;
+        dst += 32;
+    }
+
+    MaskedFillScalar(dst, mask, maskinc, len, fill0, fill1, transparent);
+}
+
+#undef MASK_BITS
+
+#endif // FILL_X86
+
+struct FillKernels
+{
+    void (*Fill)(u8* dst, u32 len, u8 fill0, u8 fill1);
+    void (*MaskedFill)(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent);
+    const char* Name;
+};
+
+FillKernels SelectKernels()
+{
+#ifdef FILL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {FillAVX2, MaskedFillAVX2, "AVX2"};
+    if (__builtin_cpu_supports("sse2"))
+        return {FillSSE2, MaskedFillSSE2, "SSE2"};
+#endif
+
+    return {FillScalar, MaskedFillScalar, "scalar"};
+}
+
+const FillKernels& GetKernels()
+{
+    // picked once, shared by all instances
+    static const FillKernels kernels = SelectKernels();
+    return kernels;
+}
+
+
+void FillSpan(u8* dst, u32 len, u8 fill0, u8 fill1)
+{
+    GetKernels().Fill(dst, len, fill0, fill1);
+}
+
+void MaskedFillSpan(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent)
+{
+    // the vector versions read mask bytes ahead of the bytes they write
+    u32 masklen = (len + 7) >> 3;
+    const u8* maskstart = (maskinc > 0) ? mask : (mask - masklen + 1);
+    if (maskstart < (dst + len) && dst < (maskstart + masklen))
+    {
+        MaskedFillScalar(dst, mask, maskinc, len, fill0, fill1, transparent);
+        return;
+    }
+
+    GetKernels().MaskedFill(dst, mask, maskinc, len, fill0, fill1, transparent);
+}
+
+const char* GetFillKernelName()
+{
+    return GetKernels().Name;
+}
+
+}
@@ -0,0 +1,45 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef DMA_FILL_H
+#define DMA_FILL_H
+
+#include "types.h"
+
+// kernels for the GPDMA fill modes. SSE2 or AVX2 versions are used when the
+// CPU supports them, otherwise plain C++
+namespace DMA
+{
+
+// fills len bytes with a 16-bit pattern: fill0 goes to even offsets, fill1
+// to odd ones
+void FillSpan(u8* dst, u32 len, u8 fill0, u8 fill1);
+
+// expands a 1bpp mask into len bytes. each mask byte covers 8 bytes, MSB
+// first: set bits write fill0, clear bits write fill1, or leave the byte
+// alone if transparent. mask bytes are read going towards maskinc (1 or -1).
+// if the mask overlaps the destination, bytes are done in order like the
+// hardware would
+void MaskedFillSpan(u8* dst, const u8* mask, int maskinc, u32 len, u8 fill0, u8 fill1, bool transparent);
+
+// which implementation is in use
+const char* GetFillKernelName();
+
+}
+
+#endif // DMA_FILL_H
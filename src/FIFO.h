@@ -20,7 +20,7 @@
 #define FIFO_H
 
 #include "types.h"
-//#include "Savestate.h"
+#include "Savestate.h"
 
 
 template<typename T, u32 NumEntries>
@@ -36,14 +36,14 @@ public:
     }
 
 
-    /*void DoSavestate(Savestate* file)
+    void DoSavestate(Savestate* file)
     {
         file->Var32(&NumOccupied);
         file->Var32(&ReadPos);
         file->Var32(&WritePos);
 
         file->VarArray(Entries, sizeof(T)*NumEntries);
-    }*/
+    }
 
 
     void Write(T val)
@@ -127,14 +127,14 @@ public:
     }
 
 
-    /*void DoSavestate(Savestate* file)
+    void DoSavestate(Savestate* file)
     {
         file->Var32(&NumOccupied);
         file->Var32(&ReadPos);
         file->Var32(&WritePos);
 
         file->VarArray(Entries, sizeof(T)*NumEntries);
-    }*/
+    }
 
 
     void Write(T val)
@@ -204,14 +204,14 @@ public:
     }
 
 
-    /*void DoSavestate(Savestate* file)
+    void DoSavestate(Savestate* file)
     {
         file->Var32(&NumOccupied);
         file->Var32(&ReadPos);
         file->Var32(&WritePos);
 
         file->VarArray(Buffer, Size);
-    }*/
+    }
 
 
     bool Write(const void* data, u32 len)
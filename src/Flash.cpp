@@ -16,53 +16,113 @@
     with pomelopad. If not, see http://www.gnu.org/licenses/.
 */
 
+#if defined(__linux__)
+#define SHARED_FIRMWARE
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef SHARED_FIRMWARE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "WUP.h"
 #include "Flash.h"
+#include "FlashJournal.h"
 #include "Platform.h"
+#include "ARMJIT.h"
 
 using Platform::Log;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 namespace Flash
 {
 
-u8 Cmd;
-u32 ByteCount;
+thread_local u8 Cmd;
+thread_local u32 ByteCount;
 
-u8 StatusReg;
-u8 AddrLen;
+thread_local u8 StatusReg;
+thread_local u8 AddrLen;
 
-const u32 kSize = 32*1024*1024;
 const u32 kAddrMask = kSize-1;
-u8* Data;
-u32 CurAddr;
+thread_local u8* Data;
+thread_local u32 CurAddr;
+
+thread_local u8 DirtyPages[kNumDirtyPages];
 
 const u8 ChipID[20] = {0x20, 0xBA, 0x19, 0x10, 0x00, 0x00, 0x23, 0x21,
                        0x61, 0x34, 0x07, 0x00, 0x30, 0x00, 0x17, 0x17,
                        0x06, 0x12, 0x4B, 0x01};
 
-u8 WriteBuffer[0x100];
-u8 WriteStart;
-u32 WriteLen;
+thread_local u8 WriteBuffer[0x100];
+thread_local u8 WriteStart;
+thread_local u32 WriteLen;
+
+thread_local u8 F2Mode;
+thread_local u16 F2Length;
+thread_local u16 F2Count;
+thread_local u8 F2DumpBuf[0x4000];
+thread_local int F2DumpCount;
+
+#ifdef SHARED_FIRMWARE
+
+// firmware images are shared by all the emulator instances that loaded the
+// same files. each image is kept in a memfd, which instances map privately,
+// so they only get their own copy of the pages they write to.
+struct SharedImage
+{
+    std::string Key;
+    int FD;
+    int Users;
+};
+
+std::mutex ImageLock;
+std::vector<SharedImage*> Images;
 
-u8 F2Mode;
-u16 F2Length;
-u16 F2Count;
-u8 F2DumpBuf[0x4000];
-int F2DumpCount;
+thread_local SharedImage* CurImage;
+
+void ReleaseImage();
+
+#endif
+
+typedef bool (*ReadFunc)(u8* dst, const char* file1, const char* file2);
 
 
 bool Init()
 {
+#ifdef SHARED_FIRMWARE
+    CurImage = nullptr;
+
+    // pages are only allocated once they're written to
+    void* mem = mmap(NULL, kSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        Log(LogLevel::Error, "flash: failed to allocate memory\n");
+        return false;
+    }
+    Data = (u8*)mem;
+#else
     Data = new u8[kSize];
+#endif
     return true;
 }
 
 void DeInit()
 {
+#ifdef SHARED_FIRMWARE
+    ReleaseImage();
+    munmap(Data, kSize);
+#else
     delete[] Data;
+#endif
+    Data = nullptr;
 }
 
 void Reset()
@@ -86,8 +146,190 @@ void Reset()
     F2DumpCount = 0;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("FLSH");
 
-bool LoadFirmware(const char* filename)
+    file->Var8(&Cmd);
+    file->Var32(&ByteCount);
+
+    file->Var8(&StatusReg);
+    file->Var8(&AddrLen);
+
+    if (!file->IsAtleastVersion(1, 1))
+    {
+        file->VarArray(Data, kSize);
+        if (!file->Saving)
+            memset(DirtyPages, WUP::Dirty_All, sizeof(DirtyPages));
+    }
+    file->Var32(&CurAddr);
+
+    file->VarArray(WriteBuffer, sizeof(WriteBuffer));
+    file->Var8(&WriteStart);
+    file->Var32(&WriteLen);
+
+    file->Var8(&F2Mode);
+    file->Var16(&F2Length);
+    file->Var16(&F2Count);
+    file->VarArray(F2DumpBuf, sizeof(F2DumpBuf));
+    file->Var32((u32*)&F2DumpCount);
+
+    if (file->IsAtleastVersion(1, 1))
+        file->DirtyArray("FDAT", Data, kSize, DirtyPages, file->DirtyBit, WUP::kDirtyPageShift);
+}
+
+
+#ifdef SHARED_FIRMWARE
+
+void ReleaseImage()
+{
+    if (!CurImage) return;
+
+    std::lock_guard<std::mutex> lock(ImageLock);
+
+    CurImage->Users--;
+    if (CurImage->Users == 0)
+    {
+        close(CurImage->FD);
+        Images.erase(std::find(Images.begin(), Images.end(), CurImage));
+        delete CurImage;
+    }
+    CurImage = nullptr;
+}
+
+SharedImage* CreateImage(const std::string& key, ReadFunc read, const char* file1, const char* file2)
+{
+    int fd = memfd_create("pomelopad firmware", 0);
+    if (fd < 0 || ftruncate(fd, kSize) < 0)
+    {
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+
+    void* mem = mmap(NULL, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    bool ok = read((u8*)mem, file1, file2);
+    munmap(mem, kSize);
+    if (!ok)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    SharedImage* img = new SharedImage;
+    img->Key = key;
+    img->FD = fd;
+    img->Users = 0;
+    Images.push_back(img);
+    return img;
+}
+
+#endif
+
+bool LoadImage(const std::string& key, ReadFunc read, const char* file1, const char* file2)
+{
+    memset(DirtyPages, WUP::Dirty_All, sizeof(DirtyPages));
+
+#ifdef SHARED_FIRMWARE
+    ReleaseImage();
+
+    std::lock_guard<std::mutex> lock(ImageLock);
+
+    SharedImage* img = nullptr;
+    for (SharedImage* cur : Images)
+    {
+        if (cur->Key == key)
+        {
+            img = cur;
+            break;
+        }
+    }
+
+    if (!img)
+    {
+        img = CreateImage(key, read, file1, file2);
+        if (!img)
+        {
+            // not shared then
+            Log(LogLevel::Warn, "flash: failed to create shared firmware image\n");
+            return read(Data, file1, file2);
+        }
+    }
+
+    void* mem = mmap(Data, kSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, img->FD, 0);
+    if (mem == MAP_FAILED)
+    {
+        Log(LogLevel::Warn, "flash: failed to map shared firmware image\n");
+        if (img->Users == 0)
+        {
+            close(img->FD);
+            Images.erase(std::find(Images.begin(), Images.end(), img));
+            delete img;
+        }
+
+        mem = mmap(Data, kSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED)
+            return false;
+        return read(Data, file1, file2);
+    }
+
+    img->Users++;
+    CurImage = img;
+    return true;
+#else
+    return read(Data, file1, file2);
+#endif
+}
+
+
+#ifdef SHARED_FIRMWARE
+
+// full firmware dumps are mapped straight from the file. pages are read in
+// as the guest accesses them, and are shared with everything else that has
+// the file mapped, until the guest writes to them
+bool MapFirmware(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    // shorter files need padding, they're loaded the regular way
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < kSize)
+    {
+        close(fd);
+        return false;
+    }
+
+    ReleaseImage();
+    memset(DirtyPages, WUP::Dirty_All, sizeof(DirtyPages));
+
+    void* mem = mmap(Data, kSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (mem != MAP_FAILED)
+    {
+        // language bank, see ReadFirmware()
+        mem = mmap(&Data[0x1100000], 0x800000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0x900000);
+    }
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        Log(LogLevel::Warn, "flash: failed to map %s\n", filename);
+        mmap(Data, kSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+bool ReadFirmware(u8* dst, const char* filename, const char*)
 {
     FILE* f = fopen(filename, "rb");
     if (!f)
@@ -97,13 +339,13 @@ bool LoadFirmware(const char* filename)
     }
 
     fseek(f, 0, SEEK_SET);
-    fread(Data, kSize, 1, f);
+    fread(dst, kSize, 1, f);
     fclose(f);
 
     // HACK
     // TODO: do this more nicely
     // language bank in firmware should match UIC setting (or vice versa)
-    memcpy(&Data[0x1100000], &Data[0x900000], 0x800000);
+    memcpy(&dst[0x1100000], &dst[0x900000], 0x800000);
 
     /*memcpy(&Data[0x0100000], &Data[0x1C00000], 0x400000);
     Data[0xF000] = 0;
@@ -117,9 +359,9 @@ bool LoadFirmware(const char* filename)
     return true;
 }
 
-bool LoadBootAndFw(const char* boot, const char* fw)
+bool ReadBootAndFw(u8* dst, const char* boot, const char* fw)
 {
-    memset(Data, 0xFF, kSize);
+    memset(dst, 0xFF, kSize);
 
     FILE* f;
     u32 len;
@@ -136,10 +378,10 @@ bool LoadBootAndFw(const char* boot, const char* fw)
     if (len > 0xE000)
         len = 0xE000;
     fseek(f, 0, SEEK_SET);
-    fread(Data, len, 1, f);
+    fread(dst, len, 1, f);
     fclose(f);
 
-    Data[0xF000] = 0;
+    dst[0xF000] = 0;
     u32 fwoffset = 0x100000;
 
     f = fopen(fw, "rb");
@@ -154,12 +396,39 @@ bool LoadBootAndFw(const char* boot, const char* fw)
     if ((fwoffset + len) > kSize)
         len = kSize - fwoffset;
     fseek(f, 0, SEEK_SET);
-    fread(&Data[fwoffset], len, 1, f);
+    fread(&dst[fwoffset], len, 1, f);
     fclose(f);
 
     return true;
 }
 
+bool LoadFirmware(const char* filename)
+{
+    FlashJournal::Close();
+
+    bool ret = false;
+#ifdef SHARED_FIRMWARE
+    ret = MapFirmware(filename);
+#endif
+    if (!ret)
+        ret = LoadImage(std::string("fw:") + filename, ReadFirmware, filename, nullptr);
+
+    if (ret)
+        FlashJournal::Open();
+    return ret;
+}
+
+bool LoadBootAndFw(const char* boot, const char* fw)
+{
+    FlashJournal::Close();
+
+    bool ret = LoadImage(std::string("boot:") + boot + "\n" + fw, ReadBootAndFw, boot, fw);
+
+    if (ret)
+        FlashJournal::Open();
+    return ret;
+}
+
 void SetupBootloader()
 {
     u32 bootsize = *(u32*)&Data[0];
@@ -170,6 +439,12 @@ void SetupBootloader()
 
     // bootloader
     memcpy(&WUP::MainRAM[0x3F0000], &Data[0x44], bootsize);
+
+    WUP::MarkRAMDirtyRange(0, 0x40);
+    WUP::MarkRAMDirtyRange(0x3F0000, bootsize);
+
+    ARMJIT::InvalidateRange(0, 0x40);
+    ARMJIT::InvalidateRange(0x3F0000, bootsize);
 }
 
 
@@ -246,25 +521,41 @@ void Release()
 {
     bool writeback = false;
 
+    // the journal keeps track of these writes by itself
+
     if (Cmd == 0x02)
     {
         // page program
-        u32 addr = CurAddr;
+        u32 start = CurAddr & kAddrMask;
+        u8 buf[0x100];
+        for (u32 i = 0; i < WriteLen; i++)
+            buf[i] = WriteBuffer[(u8)(WriteStart + i)];
+
+        // wraps around within the page
+        u32 len1 = std::min(WriteLen, 0x100 - (start & 0xFF));
+        if (len1)
+            FlashJournal::Program(start, buf, len1);
+        if (len1 < WriteLen)
+            FlashJournal::Program(start & ~0xFF, &buf[len1], WriteLen - len1);
+
+        u32 addr = start;
         for (u32 i = 0; i < WriteLen; i++)
         {
-            u8 offset = WriteStart + i;
-            Data[addr] = WriteBuffer[offset];
+            Data[addr] = buf[i];
             addr = (addr & ~0xFF) | ((addr + 1) & 0xFF);
         }
+        DirtyPages[start >> WUP::kDirtyPageShift] = WUP::Dirty_All & ~WUP::Dirty_Journal;
 
         writeback = true;
     }
     else if (Cmd == 0x20)
     {
         // subsector erase
-        u32 start = CurAddr & ~0xFFF;
-        for (u32 i = start; i < start+0x1000; i++)
-            Data[i] = 0xFF;
+        u32 start = CurAddr & kAddrMask & ~0xFFF;
+        FlashJournal::Erase(start);
+
+        memset(&Data[start], 0xFF, 0x1000);
+        DirtyPages[start >> WUP::kDirtyPageShift] = WUP::Dirty_All & ~WUP::Dirty_Journal;
 
         writeback = true;
     }
@@ -272,8 +563,6 @@ void Release()
     if (writeback)
     {
         StatusReg &= ~(1<<1);
-
-        // TODO
     }
 }
 
@@ -302,7 +591,7 @@ void Write(u8 val)
     if (ByteCount == 0)
     {
         Cmd = val;
-        printf("FLASH: cmd %02X\n", val);
+        Log(LogChannel::Flash, LogLevel::Debug, "FLASH: cmd %02X\n", val);
 
         switch (Cmd)
         {
@@ -341,19 +630,19 @@ void Write(u8 val)
             else
                 WriteLen++;
         }
-        printf("SPI02: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
+        Log(LogChannel::Flash, LogLevel::Debug, "SPI02: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
         break;
 
     case 0x03:
         if (ByteCount <= AddrLen)
             CurAddr = (CurAddr << 8) | val;
-        printf("SPI03: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
+        Log(LogChannel::Flash, LogLevel::Debug, "SPI03: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
         break;
 
     case 0x20:
         if (ByteCount <= AddrLen)
             CurAddr = (CurAddr << 8) | val;
-        printf("SPI20: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
+        Log(LogChannel::Flash, LogLevel::Debug, "SPI20: byte=%d len=%d addr=%08X\n", ByteCount, AddrLen, CurAddr);
         break;
 
     case 0xF2:
@@ -20,14 +20,27 @@
 #define FLASH_H
 
 #include "types.h"
+#include "Savestate.h"
+#include "WUP.h"
 
 namespace Flash
 {
 
+const u32 kSize = 32*1024*1024;
+const u32 kNumDirtyPages = kSize >> WUP::kDirtyPageShift;
+
+// contents, and which pages were written (see WUP::MainRAMDirty)
+extern thread_local u8* Data;
+extern thread_local u8 DirtyPages[kNumDirtyPages];
+
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
+// instances loading the same files share the same image, and only get their
+// own copy of the pages they write to. full firmware dumps are mapped from
+// the file directly, so only the pages accessed are ever read
 bool LoadFirmware(const char* filename);
 bool LoadBootAndFw(const char* boot, const char* fw);
 void SetupBootloader();
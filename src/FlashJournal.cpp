@@ -0,0 +1,542 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "WUP.h"
+#include "Flash.h"
+#include "FlashJournal.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+namespace FlashJournal
+{
+
+/*
+ * format:
+ *
+ * header
+ * 00 - magic 'PMFJ'
+ * 04 - version
+ * 06 - reserved (0)
+ * 08 - flash size
+ *
+ * then records, one after the other:
+ * 01 - program: u32 address, u16 length (up to 0x1000), data
+ * 02 - erase: u32 address of the 4KB subsector
+ *
+ * a record cut short (the emulator was killed while writing it) ends the
+ * journal. whole pages, for instance pages changed by loading a state, are
+ * saved as an erase followed by programs for what isn't blank.
+ */
+
+const u16 kVersion = 1;
+const u32 kHeaderSize = 0xC;
+
+const u32 kPageShift = 12;
+const u32 kPageSize = 1 << kPageShift;
+
+enum
+{
+    Rec_Program = 0x01,
+    Rec_Erase = 0x02,
+};
+
+// the journal gets compacted once it's bigger than this, and twice as big
+// as after the last compaction
+const u32 kCompactMinSize = 1024*1024;
+
+// what the journal says about one page
+struct Page
+{
+    u8 Data[kPageSize];
+    u8 Known[kPageSize / 8];
+};
+
+struct Writer
+{
+    std::string Filename;
+    FILE* File;
+    u32 FileSize;
+    u32 CompactedSize;
+
+    // sorted, so compacting gives the same file every time
+    std::map<u32, Page*> Pages;
+
+    std::thread Thread;
+    std::mutex Lock;
+    std::condition_variable Cond;
+    std::vector<u8> Queue;
+    bool Quit;
+};
+
+thread_local std::string Filename;
+thread_local Writer* CurWriter;
+
+// records from the current frame
+thread_local std::vector<u8> Pending;
+thread_local std::vector<u32> PendingPages;
+
+
+bool Init()
+{
+    Filename.clear();
+    CurWriter = nullptr;
+    Pending.clear();
+    PendingPages.clear();
+    return true;
+}
+
+void DeInit()
+{
+    Close();
+}
+
+void SetFile(const std::string& filename)
+{
+    Filename = filename;
+}
+
+
+void Put8(std::vector<u8>& out, u8 val)
+{
+    out.push_back(val);
+}
+
+void Put16(std::vector<u8>& out, u16 val)
+{
+    out.push_back(val & 0xFF);
+    out.push_back(val >> 8);
+}
+
+void Put32(std::vector<u8>& out, u32 val)
+{
+    Put16(out, val & 0xFFFF);
+    Put16(out, val >> 16);
+}
+
+void PutHeader(std::vector<u8>& out)
+{
+    out.insert(out.end(), {'P', 'M', 'F', 'J'});
+    Put16(out, kVersion);
+    Put16(out, 0);
+    Put32(out, Flash::kSize);
+}
+
+void PutProgram(std::vector<u8>& out, u32 addr, const u8* data, u32 len)
+{
+    Put8(out, Rec_Program);
+    Put32(out, addr);
+    Put16(out, len);
+    out.insert(out.end(), data, data + len);
+}
+
+void PutErase(std::vector<u8>& out, u32 addr)
+{
+    Put8(out, Rec_Erase);
+    Put32(out, addr);
+}
+
+// whole page, as an erase followed by whatever isn't blank
+void PutPage(std::vector<u8>& out, u32 addr, const u8* data)
+{
+    PutErase(out, addr);
+
+    u32 i = 0;
+    while (i < kPageSize)
+    {
+        if (data[i] == 0xFF)
+        {
+            i++;
+            continue;
+        }
+
+        // short blank gaps cost less than a new record
+        u32 start = i;
+        u32 end = i;
+        while (i < kPageSize && (i - end) < 8)
+        {
+            if (data[i] != 0xFF)
+                end = i + 1;
+            i++;
+        }
+        PutProgram(out, addr + start, &data[start], end - start);
+        i = end;
+    }
+}
+
+
+Page* GetPage(Writer* w, u32 addr)
+{
+    Page*& page = w->Pages[addr >> kPageShift];
+    if (!page)
+    {
+        page = new Page;
+        memset(page->Known, 0, sizeof(page->Known));
+    }
+    return page;
+}
+
+// applies records to the pages, and to the flash if given. returns how much
+// of the data was valid
+u32 ApplyRecords(Writer* w, const u8* data, u32 len, u8* flash)
+{
+    u32 pos = 0;
+    while (pos < len)
+    {
+        u8 type = data[pos];
+        if (type == Rec_Program)
+        {
+            if ((pos + 7) > len) break;
+            u32 addr; u16 num;
+            memcpy(&addr, &data[pos+1], 4);
+            memcpy(&num, &data[pos+5], 2);
+            if (!num || num > kPageSize || (addr >> kPageShift) != ((addr + num - 1) >> kPageShift)) break;
+            if (addr >= Flash::kSize || (pos + 7 + num) > len) break;
+
+            const u8* src = &data[pos+7];
+            Page* page = GetPage(w, addr);
+            u32 offset = addr & (kPageSize-1);
+            memcpy(&page->Data[offset], src, num);
+            for (u32 i = offset; i < offset+num; i++)
+                page->Known[i >> 3] |= (1 << (i & 7));
+
+            if (flash)
+                memcpy(&flash[addr], src, num);
+
+            pos += 7 + num;
+        }
+        else if (type == Rec_Erase)
+        {
+            if ((pos + 5) > len) break;
+            u32 addr;
+            memcpy(&addr, &data[pos+1], 4);
+            if ((addr & (kPageSize-1)) || addr >= Flash::kSize) break;
+
+            Page* page = GetPage(w, addr);
+            memset(page->Data, 0xFF, kPageSize);
+            memset(page->Known, 0xFF, sizeof(page->Known));
+
+            if (flash)
+                memset(&flash[addr], 0xFF, kPageSize);
+
+            pos += 5;
+        }
+        else
+            break;
+    }
+
+    return pos;
+}
+
+// rewrites the journal with only what's needed to rebuild the pages
+bool Compact(Writer* w)
+{
+    std::vector<u8> out;
+    PutHeader(out);
+
+    for (auto& entry : w->Pages)
+    {
+        u32 addr = entry.first << kPageShift;
+        Page* page = entry.second;
+
+        bool full = true;
+        for (u32 i = 0; i < sizeof(page->Known); i++)
+        {
+            if (page->Known[i] != 0xFF)
+            {
+                full = false;
+                break;
+            }
+        }
+
+        if (full)
+        {
+            PutPage(out, addr, page->Data);
+            continue;
+        }
+
+        // only parts of the page were programmed
+        u32 i = 0;
+        while (i < kPageSize)
+        {
+            if (!(page->Known[i >> 3] & (1 << (i & 7))))
+            {
+                i++;
+                continue;
+            }
+
+            u32 start = i;
+            while (i < kPageSize && (page->Known[i >> 3] & (1 << (i & 7))))
+                i++;
+            PutProgram(out, addr + start, &page->Data[start], i - start);
+        }
+    }
+
+    // the old journal stays until the new one is complete
+    std::string tmpname = w->Filename + ".tmp";
+    FILE* f = fopen(tmpname.c_str(), "wb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "flash journal: failed to open %s\n", tmpname.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(out.data(), out.size(), 1, f) == 1;
+    ok = (fflush(f) == 0) && ok;
+#ifndef _WIN32
+    ok = (fsync(fileno(f)) == 0) && ok;
+#endif
+    fclose(f);
+
+    if (w->File)
+    {
+        fclose(w->File);
+        w->File = nullptr;
+    }
+
+#ifdef _WIN32
+    if (ok) remove(w->Filename.c_str());
+#endif
+    if (!ok || rename(tmpname.c_str(), w->Filename.c_str()))
+    {
+        Log(LogLevel::Error, "flash journal: failed to compact %s\n", w->Filename.c_str());
+        remove(tmpname.c_str());
+        w->File = fopen(w->Filename.c_str(), "ab");
+        return false;
+    }
+
+    w->File = fopen(w->Filename.c_str(), "ab");
+    w->FileSize = out.size();
+    w->CompactedSize = out.size();
+    return w->File != nullptr;
+}
+
+void WriterThread(Writer* w)
+{
+    std::vector<u8> data;
+    for (;;)
+    {
+        bool quit;
+        {
+            std::unique_lock<std::mutex> lock(w->Lock);
+            w->Cond.wait(lock, [w]() { return w->Quit || !w->Queue.empty(); });
+            data.swap(w->Queue);
+            quit = w->Quit;
+        }
+
+        if (!data.empty())
+        {
+            ApplyRecords(w, data.data(), data.size(), nullptr);
+
+            if (w->File)
+            {
+                if (fwrite(data.data(), data.size(), 1, w->File) != 1 || fflush(w->File))
+                    Log(LogLevel::Error, "flash journal: failed to write to %s\n", w->Filename.c_str());
+                w->FileSize += data.size();
+            }
+            data.clear();
+
+            if (w->FileSize > kCompactMinSize && w->FileSize > (w->CompactedSize * 2))
+                Compact(w);
+        }
+
+        if (quit) break;
+    }
+
+    Compact(w);
+}
+
+
+bool Open()
+{
+    Close();
+    if (Filename.empty())
+        return true;
+
+    Writer* w = new Writer;
+    w->Filename = Filename;
+    w->File = nullptr;
+    w->FileSize = 0;
+    w->CompactedSize = 0;
+    w->Quit = false;
+
+    std::vector<u8> data;
+    FILE* f = fopen(Filename.c_str(), "rb");
+    if (f)
+    {
+        fseek(f, 0, SEEK_END);
+        u32 len = (u32)ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        data.resize(len);
+        if (len && fread(data.data(), len, 1, f) != 1)
+            data.clear();
+        fclose(f);
+    }
+
+    if (!data.empty())
+    {
+        u32 size;
+        if (data.size() >= kHeaderSize)
+            memcpy(&size, &data[8], 4);
+        if (data.size() < kHeaderSize || memcmp(&data[0], "PMFJ", 4) ||
+            *(u16*)&data[4] != kVersion || size != Flash::kSize)
+        {
+            // better not write over whatever that is
+            Log(LogLevel::Error, "flash journal: %s isn't a valid journal, not using it\n", Filename.c_str());
+            delete w;
+            return false;
+        }
+
+        u32 len = data.size() - kHeaderSize;
+        u32 valid = ApplyRecords(w, &data[kHeaderSize], len, Flash::Data);
+        if (valid < len)
+            Log(LogLevel::Warn, "flash journal: %s is cut short, dropping the last %d bytes\n", Filename.c_str(), len - valid);
+
+        Log(LogLevel::Info, "flash journal: %d pages restored from %s\n", (u32)w->Pages.size(), Filename.c_str());
+    }
+
+    // the journal now matches the flash, and will start out compacted.
+    // everything already counts as written for the other users
+    for (u32 i = 0; i < Flash::kNumDirtyPages; i++)
+        Flash::DirtyPages[i] &= ~WUP::Dirty_Journal;
+
+    if (!Compact(w))
+    {
+        for (auto& entry : w->Pages)
+            delete entry.second;
+        if (w->File) fclose(w->File);
+        delete w;
+        return false;
+    }
+
+    Pending.clear();
+    PendingPages.clear();
+
+    w->Thread = std::thread(WriterThread, w);
+    CurWriter = w;
+    return true;
+}
+
+void Close()
+{
+    Writer* w = CurWriter;
+    if (!w) return;
+
+    CommitFrame();
+
+    {
+        std::lock_guard<std::mutex> lock(w->Lock);
+        w->Quit = true;
+    }
+    w->Cond.notify_one();
+    w->Thread.join();
+
+    for (auto& entry : w->Pages)
+        delete entry.second;
+    if (w->File) fclose(w->File);
+    delete w;
+
+    CurWriter = nullptr;
+    Pending.clear();
+    PendingPages.clear();
+}
+
+
+void TouchPage(u32 addr)
+{
+    u32 page = addr >> kPageShift;
+
+    // the page was changed some other way since the last frame (loading a
+    // state, etc), its whole contents have to be saved first
+    if (Flash::DirtyPages[page] & WUP::Dirty_Journal)
+    {
+        PutPage(Pending, page << kPageShift, &Flash::Data[page << kPageShift]);
+        Flash::DirtyPages[page] &= ~WUP::Dirty_Journal;
+    }
+
+    PendingPages.push_back(page);
+}
+
+void Program(u32 addr, const u8* data, u32 len)
+{
+    if (!CurWriter) return;
+
+    TouchPage(addr);
+    PutProgram(Pending, addr, data, len);
+}
+
+void Erase(u32 addr)
+{
+    if (!CurWriter) return;
+
+    TouchPage(addr);
+    PutErase(Pending, addr);
+}
+
+void CommitFrame()
+{
+    Writer* w = CurWriter;
+    if (!w) return;
+
+    for (u32 i = 0; i < Flash::kNumDirtyPages; i++)
+    {
+        if (Flash::DirtyPages[i] & WUP::Dirty_Journal)
+        {
+            PutPage(Pending, i << kPageShift, &Flash::Data[i << kPageShift]);
+            Flash::DirtyPages[i] &= ~WUP::Dirty_Journal;
+        }
+    }
+
+    PendingPages.clear();
+    if (Pending.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(w->Lock);
+        w->Queue.insert(w->Queue.end(), Pending.begin(), Pending.end());
+    }
+    w->Cond.notify_one();
+    Pending.clear();
+}
+
+void DiscardFrame()
+{
+    if (!CurWriter) return;
+
+    // restoring the state put these pages back the way they were
+    for (u32 page : PendingPages)
+        Flash::DirtyPages[page] &= ~WUP::Dirty_Journal;
+
+    Pending.clear();
+    PendingPages.clear();
+}
+
+}
@@ -0,0 +1,64 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef FLASHJOURNAL_H
+#define FLASHJOURNAL_H
+
+#include <string>
+
+#include "types.h"
+
+// persistent flash
+//
+// page programs and erases done by the firmware are appended to a journal
+// file, which is replayed over the firmware image when it gets loaded, so
+// settings and such survive between runs. the firmware image itself is never
+// modified.
+// the emulator only queues records, a separate thread writes them out. once
+// the journal has grown enough, it's compacted down to the latest contents
+// of each page touched.
+// only what the real frames do is kept: writes done by run-ahead frames are
+// dropped, and pages changed by loading a state or rewinding are saved whole.
+
+namespace FlashJournal
+{
+
+bool Init();
+void DeInit();
+
+// journal to use for the firmware loaded next, empty for none
+void SetFile(const std::string& filename);
+
+// called by Flash once the image is loaded: replays the journal over it,
+// and starts writing to it
+bool Open();
+// writes out everything still queued
+void Close();
+
+// called by Flash::Release(), before the write is done
+void Program(u32 addr, const u8* data, u32 len);
+void Erase(u32 addr);
+
+// called after each frame by WUP::RunFrame(), hands over what it wrote
+void CommitFrame();
+// called by RunAhead after restoring the state
+void DiscardFrame();
+
+}
+
+#endif // FLASHJOURNAL_H
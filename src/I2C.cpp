@@ -27,12 +27,13 @@
 
 using Platform::Log;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 namespace I2C
 {
 
-u32 ChanEnable; // CHECKME -- might just be IRQ enable??
-u32 ChanIRQ;
+thread_local u32 ChanEnable; // CHECKME -- might just be IRQ enable??
+thread_local u32 ChanIRQ;
 
 struct sDevice
 {
@@ -88,6 +89,22 @@ struct sHostChan
         CurDevice = nullptr;
     }
 
+    void DoSavestate(Savestate* file)
+    {
+        file->Var32(&Unk00);
+        file->Var32(&Cnt);
+        file->Var32(&Unk10);
+        file->Var32(&Status);
+        file->Var32(&Unk20);
+        file->Var8(&DataRead);
+
+        // devices are registered at init, only keep track of the current one
+        s32 curdev = CurDevice ? (s32)(CurDevice - Devices) : -1;
+        file->Var32((u32*)&curdev);
+        if (!file->Saving)
+            CurDevice = (curdev >= 0 && curdev < NumDevices) ? &Devices[curdev] : nullptr;
+    }
+
     void WriteCnt(u32 val)
     {
         Cnt = val;
@@ -96,7 +113,7 @@ struct sHostChan
         {
             // stop
 
-            printf("-- I2C: stop\n");
+            Log(LogChannel::I2C, LogLevel::Debug, "-- I2C: stop\n");
             if (CurDevice)
             {
                 CurDevice->fnStop();
@@ -114,7 +131,7 @@ struct sHostChan
 
             if (Cnt & (1<<2))
             {
-                printf("-- I2C: read (%02X)\n", Cnt);
+                Log(LogChannel::I2C, LogLevel::Debug, "-- I2C: read (%02X)\n", Cnt);
                 if (CurDevice)
                 {
                     DataRead = CurDevice->fnRead();
@@ -140,7 +157,7 @@ struct sHostChan
             // start
             u8 devaddr = val >> 1;
             bool read = !!(val & (1<<0));
-            printf("-- I2C: start, dev=%02X read=%d\n", devaddr, read);
+            Log(LogChannel::I2C, LogLevel::Debug, "-- I2C: start, dev=%02X read=%d\n", devaddr, read);
 
             CurDevice = nullptr;
             for (int i = 0; i < NumDevices; i++)
@@ -167,7 +184,7 @@ struct sHostChan
         }
         else
         {
-            printf("-- I2C: write %02X\n", val);
+            Log(LogChannel::I2C, LogLevel::Debug, "-- I2C: write %02X\n", val);
             if (CurDevice)
             {
                 CurDevice->fnWrite(val);
@@ -222,7 +239,7 @@ struct sHostChan
     }
 };
 
-sHostChan HostChan[3];
+thread_local sHostChan HostChan[3];
 
 
 bool Init()
@@ -251,6 +268,17 @@ void Reset()
         HostChan[i].Reset();
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("I2C.");
+
+    file->Var32(&ChanEnable);
+    file->Var32(&ChanIRQ);
+
+    for (int i = 0; i < 3; i++)
+        HostChan[i].DoSavestate(file);
+}
+
 
 void SetIRQ(int chan)
 {
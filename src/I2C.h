@@ -20,6 +20,7 @@
 #define I2C_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace I2C
 {
@@ -27,6 +28,7 @@ namespace I2C
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void SetIRQ(int chan);
 
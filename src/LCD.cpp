@@ -28,13 +28,13 @@ using Platform::LogLevel;
 namespace LCD
 {
 
-u8 Cmd;
-bool GotCmd;
-u32 CurAddr;
+thread_local u8 Cmd;
+thread_local bool GotCmd;
+thread_local u32 CurAddr;
 
 const u8 ID[5] = {0x01, 0x22, 0x92, 0x08, 0xA0};
 
-u8 Status;
+thread_local u8 Status;
 
 
 bool Init()
@@ -55,6 +55,16 @@ void Reset()
     Status = 0;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("LCD.");
+
+    file->Var8(&Cmd);
+    file->Bool32(&GotCmd);
+    file->Var32(&CurAddr);
+    file->Var8(&Status);
+}
+
 
 void Start()
 {
@@ -20,6 +20,7 @@
 #define LCD_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace LCD
 {
@@ -27,6 +28,7 @@ namespace LCD
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void Start();
 void Stop();
@@ -0,0 +1,384 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "WUP.h"
+#include "UIC.h"
+#include "Movie.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+namespace Movie
+{
+
+/*
+ * format:
+ *
+ * header
+ * 00 - magic 'PMMV'
+ * 04 - version
+ * 06 - reserved (0)
+ * 08 - number of frames
+ * 0C - frame number the movie starts at
+ *
+ * then for each frame, a flags byte followed by whatever changed since the
+ * previous frame (everything, for the first frame):
+ * bit 0 - key mask follows (u32)
+ * bit 1 - touch follows (u8 touching, u16 X, u16 Y)
+ * bit 2 - volume follows (u8)
+ * bit 7 - lag frame, checked on playback to detect desyncs
+ */
+
+const u16 kVersion = 1;
+const u32 kHeaderSize = 0x10;
+
+enum
+{
+    Mode_None = 0,
+    Mode_Record,
+    Mode_Play,
+};
+
+struct Frame
+{
+    UIC::InputState Input;
+    bool Lag;
+};
+
+thread_local int Mode;
+thread_local std::string Filename;
+
+thread_local u32 StartFrame;
+thread_local std::vector<Frame> Frames;
+thread_local u32 CurFrame;
+
+thread_local u32 NumDesyncs;
+
+
+bool Init()
+{
+    Mode = Mode_None;
+    Frames.clear();
+    StartFrame = 0;
+    CurFrame = 0;
+    NumDesyncs = 0;
+    return true;
+}
+
+void DeInit()
+{
+    Stop();
+}
+
+
+void Put8(std::vector<u8>& out, u8 val)
+{
+    out.push_back(val);
+}
+
+void Put16(std::vector<u8>& out, u16 val)
+{
+    out.push_back(val & 0xFF);
+    out.push_back(val >> 8);
+}
+
+void Put32(std::vector<u8>& out, u32 val)
+{
+    Put16(out, val & 0xFFFF);
+    Put16(out, val >> 16);
+}
+
+bool WriteMovie()
+{
+    std::vector<u8> data;
+    data.reserve(kHeaderSize + Frames.size() * 2);
+
+    data.insert(data.end(), {'P', 'M', 'M', 'V'});
+    Put16(data, kVersion);
+    Put16(data, 0);
+    Put32(data, Frames.size());
+    Put32(data, StartFrame);
+
+    const UIC::InputState* prev = nullptr;
+    for (const Frame& frame : Frames)
+    {
+        const UIC::InputState& cur = frame.Input;
+
+        u8 flags = 0;
+        if (!prev || cur.KeyMask != prev->KeyMask)
+            flags |= (1<<0);
+        if (!prev || cur.Touching != prev->Touching || cur.TouchX != prev->TouchX || cur.TouchY != prev->TouchY)
+            flags |= (1<<1);
+        if (!prev || cur.Volume != prev->Volume)
+            flags |= (1<<2);
+        if (frame.Lag)
+            flags |= (1<<7);
+
+        Put8(data, flags);
+        if (flags & (1<<0))
+            Put32(data, cur.KeyMask);
+        if (flags & (1<<1))
+        {
+            Put8(data, cur.Touching ? 1 : 0);
+            Put16(data, cur.TouchX);
+            Put16(data, cur.TouchY);
+        }
+        if (flags & (1<<2))
+            Put8(data, cur.Volume);
+
+        prev = &cur;
+    }
+
+    FILE* f = fopen(Filename.c_str(), "wb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "movie: failed to open %s\n", Filename.c_str());
+        return false;
+    }
+
+    bool ret = fwrite(data.data(), data.size(), 1, f) == 1;
+    fclose(f);
+    return ret;
+}
+
+bool ReadMovie()
+{
+    FILE* f = fopen(Filename.c_str(), "rb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "movie: failed to open %s\n", Filename.c_str());
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    u32 len = (u32)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    std::vector<u8> data(len);
+    bool ok = len && fread(data.data(), len, 1, f) == 1;
+    fclose(f);
+
+    if (!ok || len < kHeaderSize || memcmp(&data[0], "PMMV", 4))
+    {
+        Log(LogLevel::Error, "movie: %s isn't a valid movie\n", Filename.c_str());
+        return false;
+    }
+
+    u32 pos = 4;
+    auto get8 = [&]() -> u8 { return (pos < len) ? data[pos++] : 0; };
+    auto get16 = [&]() -> u16 { u16 lo = get8(); return lo | (get8() << 8); };
+    auto get32 = [&]() -> u32 { u32 lo = get16(); return lo | (get16() << 16); };
+
+    u16 version = get16();
+    if (version != kVersion)
+    {
+        Log(LogLevel::Error, "movie: bad version %d, expecting %d\n", version, kVersion);
+        return false;
+    }
+    get16();
+    u32 numframes = get32();
+    StartFrame = get32();
+
+    Frames.clear();
+    Frames.reserve(numframes);
+
+    Frame frame = {};
+    for (u32 i = 0; i < numframes; i++)
+    {
+        if (pos >= len)
+        {
+            Log(LogLevel::Error, "movie: truncated, %d frames out of %d\n", i, numframes);
+            return false;
+        }
+
+        u8 flags = get8();
+        if (flags & (1<<0))
+            frame.Input.KeyMask = get32();
+        if (flags & (1<<1))
+        {
+            frame.Input.Touching = get8() != 0;
+            frame.Input.TouchX = get16();
+            frame.Input.TouchY = get16();
+        }
+        if (flags & (1<<2))
+            frame.Input.Volume = get8();
+        frame.Lag = (flags & (1<<7)) != 0;
+
+        Frames.push_back(frame);
+    }
+
+    return true;
+}
+
+
+bool StartRecording(const char* filename)
+{
+    Stop();
+
+    Filename = filename;
+    StartFrame = WUP::NumFrames;
+    Frames.clear();
+    CurFrame = 0;
+    NumDesyncs = 0;
+
+    // make sure we can write there before anything is recorded
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "movie: failed to open %s\n", filename);
+        return false;
+    }
+    fclose(f);
+
+    Mode = Mode_Record;
+    return true;
+}
+
+bool StartPlayback(const char* filename)
+{
+    Stop();
+
+    Filename = filename;
+    CurFrame = 0;
+    NumDesyncs = 0;
+
+    if (!ReadMovie())
+    {
+        Frames.clear();
+        return false;
+    }
+
+    if (WUP::NumFrames != StartFrame)
+        Log(LogLevel::Warn, "movie: starts at frame %d, currently at frame %d\n", StartFrame, WUP::NumFrames);
+
+    // frames are counted from here
+    StartFrame = WUP::NumFrames;
+
+    Mode = Mode_Play;
+    return true;
+}
+
+void Stop()
+{
+    if (Mode == Mode_Record)
+    {
+        if (!WriteMovie())
+            Log(LogLevel::Error, "movie: failed to save %s\n", Filename.c_str());
+    }
+    else if (Mode == Mode_Play && NumDesyncs)
+    {
+        Log(LogLevel::Warn, "movie: playback desynced on %d frames\n", NumDesyncs);
+    }
+
+    Mode = Mode_None;
+}
+
+bool IsRecording()
+{
+    return Mode == Mode_Record;
+}
+
+bool IsPlaying()
+{
+    return Mode == Mode_Play;
+}
+
+u32 NumFrames()
+{
+    return Frames.size();
+}
+
+u32 CurrentFrame()
+{
+    return CurFrame;
+}
+
+
+void FrameStart()
+{
+    if (Mode == Mode_None) return;
+
+    if (WUP::NumFrames < StartFrame)
+    {
+        Log(LogLevel::Warn, "movie: went back before the start of the movie, stopping\n");
+        Stop();
+        return;
+    }
+
+    u32 frame = WUP::NumFrames - StartFrame;
+
+    if (Mode == Mode_Record)
+    {
+        // after rewinding or loading a state, the rest gets recorded over
+        if (frame > Frames.size())
+        {
+            Log(LogLevel::Warn, "movie: jumped past the end of the movie, stopping\n");
+            Stop();
+            return;
+        }
+        Frames.resize(frame);
+
+        Frame cur;
+        UIC::GetInputState(&cur.Input);
+        cur.Lag = false;
+        Frames.push_back(cur);
+    }
+    else
+    {
+        if (frame >= Frames.size())
+        {
+            Log(LogLevel::Info, "movie: playback finished\n");
+            Stop();
+            return;
+        }
+
+        UIC::SetInputState(&Frames[frame].Input);
+    }
+
+    CurFrame = frame;
+}
+
+void FrameEnd()
+{
+    if (Mode == Mode_Record)
+    {
+        Frames[CurFrame].Lag = WUP::LagFrameFlag;
+    }
+    else if (Mode == Mode_Play)
+    {
+        if (Frames[CurFrame].Lag != WUP::LagFrameFlag)
+        {
+            if (!NumDesyncs)
+                Log(LogLevel::Warn, "movie: desync at frame %d\n", CurFrame);
+            NumDesyncs++;
+        }
+
+        if ((CurFrame + 1) >= Frames.size())
+        {
+            Log(LogLevel::Info, "movie: playback finished\n");
+            Stop();
+        }
+    }
+}
+
+}
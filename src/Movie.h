@@ -0,0 +1,58 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "types.h"
+
+// input movies
+//
+// the input seen by the firmware is recorded once per frame, so that the
+// exact same run can be replayed later. input from the frontend is ignored
+// during playback. the emulator is otherwise deterministic, so a movie
+// started right after loading the same firmware (and with the same
+// uic_config.bin) reproduces the same guest execution.
+// frames are counted with WUP::NumFrames, so rewinding or loading a state
+// while recording starts recording over from that point.
+
+namespace Movie
+{
+
+bool Init();
+void DeInit();
+
+// recording is written to the file when stopped
+bool StartRecording(const char* filename);
+bool StartPlayback(const char* filename);
+void Stop();
+
+bool IsRecording();
+bool IsPlaying();
+
+// length of the movie, and position in it
+u32 NumFrames();
+u32 CurrentFrame();
+
+// called by WUP::RunFrame()
+void FrameStart();
+void FrameEnd();
+
+}
+
+#endif // MOVIE_H
@@ -21,7 +21,16 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include "Platform.h"
 
@@ -30,21 +39,334 @@
 namespace Platform
 {
 
+std::atomic<u8> LogMinLevel[(int)LogChannel::Count] =
+{
+    LogLevel::Info, LogLevel::Info, LogLevel::Info,
+    LogLevel::Info, LogLevel::Info, LogLevel::Info,
+};
+
+const char* LogChannelNames[(int)LogChannel::Count] =
+{
+    "core", "flash", "i2c", "wifi", "irq", "dma",
+};
+
+
+/*
+ * log queue
+ *
+ * bounded multi-producer ring buffer: several emulator instances may be
+ * logging at once, and one writer thread empties it.
+ *
+ * each slot has a sequence number counting how many times it was used:
+ * during lap N (position / kLogQueueSize), the slot is free to write when
+ * its sequence is 2N, and holds a message ready to be read when it's 2N+1.
+ * reading it moves it to 2N+2, which frees it for the next lap. this way
+ * the queue starts out valid with everything zeroed.
+ */
+
+const u32 kLogQueueSize = 4096;
+const u32 kLogMsgLength = 256;
+
+struct LogSlot
+{
+    std::atomic<u32> Seq;
+    u32 Length;
+    char Text[kLogMsgLength];
+};
+
+LogSlot LogQueue[kLogQueueSize];
+std::atomic<u32> LogHead; // next position to write to
+u32 LogTail; // next position to read from, only used by the writer
+
+std::atomic<u32> LogDropped;
+
+// the writer thread is started on the first message. a forked child
+// doesn't inherit it, so it starts its own
+std::atomic<bool> WriterStarted;
+// the writer sleeps while there's nothing to write, producers only wake it
+// up when this is set
+std::atomic<bool> WriterSleeping;
+std::mutex WriterLock;
+std::condition_variable WriterWake;
+std::atomic<bool> WriterQuit;
+std::atomic<bool> WriterDone;
+std::atomic<u32> WriterFlushed; // everything before this position was written
+
+
+bool QueueEmpty()
+{
+    LogSlot* slot = &LogQueue[LogTail % kLogQueueSize];
+    u32 lap = LogTail / kLogQueueSize;
+    return slot->Seq.load() != ((lap * 2) + 1);
+}
+
+bool QueueRead(char* out, u32* len)
+{
+    LogSlot* slot = &LogQueue[LogTail % kLogQueueSize];
+    u32 lap = LogTail / kLogQueueSize;
+    if (slot->Seq.load(std::memory_order_acquire) != ((lap * 2) + 1))
+        return false;
+
+    *len = slot->Length;
+    memcpy(out, slot->Text, slot->Length);
+
+    slot->Seq.store((lap * 2) + 2, std::memory_order_release);
+    LogTail++;
+    return true;
+}
+
+void WriteQueued()
+{
+    char buf[16384];
+    u32 buflen = 0;
+    bool written = false;
+
+    for (;;)
+    {
+        u32 len;
+        if ((buflen + kLogMsgLength) > sizeof(buf) || !QueueRead(&buf[buflen], &len))
+        {
+            if (!buflen) break;
+            fwrite(buf, buflen, 1, stdout);
+            buflen = 0;
+            written = true;
+            continue;
+        }
+        buflen += len;
+    }
+
+    u32 dropped = LogDropped.exchange(0, std::memory_order_relaxed);
+    if (dropped)
+    {
+        printf("[log: %u messages dropped]\n", dropped);
+        written = true;
+    }
+
+    if (written)
+        fflush(stdout);
+    WriterFlushed.store(LogTail, std::memory_order_release);
+}
+
+void WriterThread()
+{
+    while (!WriterQuit.load(std::memory_order_acquire))
+    {
+        WriteQueued();
+
+        // check again once the flag is set, so that a message queued in
+        // between isn't missed (see WakeWriter())
+        std::unique_lock<std::mutex> lock(WriterLock);
+        WriterSleeping.store(true);
+        if (QueueEmpty() && !LogDropped.load() && !WriterQuit.load())
+            WriterWake.wait(lock);
+        WriterSleeping.store(false, std::memory_order_relaxed);
+    }
+
+    WriteQueued();
+    WriterDone.store(true, std::memory_order_release);
+}
+
+void WakeWriter()
+{
+    if (!WriterSleeping.load())
+        return;
+
+    // the writer holds the lock from checking the queue until it waits
+    {
+        std::lock_guard<std::mutex> lock(WriterLock);
+    }
+    WriterWake.notify_one();
+}
+
+void StopWriter()
+{
+    if (!WriterStarted) return;
+
+    WriterQuit.store(true);
+    WakeWriter();
+
+    // don't hang on exit if the writer is stuck somehow
+    for (int i = 0; i < 1000 && !WriterDone.load(std::memory_order_acquire); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+#ifndef _WIN32
+// the writer can't be holding the lock while forking, or the child would be
+// stuck with it
+void BeforeFork()
+{
+    WriterLock.lock();
+}
+
+void AfterForkParent()
+{
+    WriterLock.unlock();
+}
+
+void AfterForkChild()
+{
+    WriterLock.unlock();
+
+    // whatever was still queued belongs to the parent
+    u32 head = LogHead.load(std::memory_order_relaxed);
+    while (LogTail != head)
+    {
+        LogQueue[LogTail % kLogQueueSize].Seq.store(((LogTail / kLogQueueSize) * 2) + 2, std::memory_order_relaxed);
+        LogTail++;
+    }
+    WriterFlushed.store(LogTail, std::memory_order_relaxed);
+
+    WriterStarted = false;
+    WriterSleeping = false;
+    WriterQuit = false;
+    WriterDone = false;
+}
+#endif
+
+void StartWriter()
+{
+    bool expected = false;
+    if (!WriterStarted.compare_exchange_strong(expected, true))
+        return;
+
+    static bool registered = false;
+    if (!registered)
+    {
+        registered = true;
+        atexit(StopWriter);
+#ifndef _WIN32
+        pthread_atfork(BeforeFork, AfterForkParent, AfterForkChild);
+#endif
+    }
+
+    std::thread(WriterThread).detach();
+}
+
+void QueueMessage(const char* fmt, va_list args)
+{
+    if (!WriterStarted.load(std::memory_order_acquire))
+        StartWriter();
+
+    u32 pos = LogHead.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;)
+    {
+        slot = &LogQueue[pos % kLogQueueSize];
+        u32 lap = pos / kLogQueueSize;
+        s32 diff = (s32)(slot->Seq.load(std::memory_order_acquire) - (lap * 2));
+
+        if (diff == 0)
+        {
+            if (LogHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // the slot wasn't read yet, the queue is full
+            LogDropped.fetch_add(1);
+            WakeWriter();
+            return;
+        }
+        else
+            pos = LogHead.load(std::memory_order_relaxed);
+    }
+
+    int len = vsnprintf(slot->Text, kLogMsgLength, fmt, args);
+    if (len < 0) len = 0;
+    if (len >= (int)kLogMsgLength)
+    {
+        len = kLogMsgLength - 1;
+        slot->Text[len - 1] = '\n';
+    }
+    slot->Length = len;
+
+    slot->Seq.store(((pos / kLogQueueSize) * 2) + 1);
+    WakeWriter();
+}
+
+
+void SetLogLevel(LogChannel chan, LogLevel level)
+{
+    LogMinLevel[(int)chan].store(level, std::memory_order_relaxed);
+}
+
+bool SetLogLevel(const char* channame, LogLevel level)
+{
+    for (int i = 0; i < (int)LogChannel::Count; i++)
+    {
+        if (!strcmp(channame, LogChannelNames[i]))
+        {
+            SetLogLevel((LogChannel)i, level);
+            return true;
+        }
+    }
 
+    return false;
+}
 
 void Log(LogLevel level, const char* fmt, ...)
 {
     if (fmt == nullptr)
         return;
-    if (level <= LogLevel::Debug)
+    if (!LogEnabled(LogChannel::Core, level))
         return;
 
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    QueueMessage(fmt, args);
+    va_end(args);
+}
+
+void LogMsg(LogChannel, LogLevel, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    QueueMessage(fmt, args);
+    va_end(args);
+}
+
+void QueueHex(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    QueueMessage(fmt, args);
     va_end(args);
 }
 
+void LogHexMsg(LogChannel, LogLevel, const u8* data, u32 len)
+{
+    const char* hex = "0123456789ABCDEF";
+
+    for (u32 i = 0; i < len; i += 32)
+    {
+        char line[32*3 + 1];
+        u32 n = std::min(len - i, 32u);
+        for (u32 j = 0; j < n; j++)
+        {
+            line[j*3 + 0] = hex[data[i+j] >> 4];
+            line[j*3 + 1] = hex[data[i+j] & 0xF];
+            line[j*3 + 2] = ':';
+        }
+        line[n*3 - 1] = '\0';
+
+        QueueHex("%08X: %s\n", i, line);
+    }
+}
+
+void FlushLog()
+{
+    if (!WriterStarted.load(std::memory_order_acquire))
+        return;
+
+    u32 head = LogHead.load(std::memory_order_acquire);
+    for (int i = 0; i < 1000; i++)
+    {
+        if ((s32)(WriterFlushed.load(std::memory_order_acquire) - head) >= 0)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
 
 
 }
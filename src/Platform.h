@@ -21,9 +21,16 @@
 
 #include "types.h"
 
+#include <atomic>
 #include <functional>
 #include <string>
 
+#ifdef __GNUC__
+#define LOG_PRINTF(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOG_PRINTF(fmt, args)
+#endif
+
 namespace Platform
 {
 
@@ -37,7 +44,59 @@ enum LogLevel
     Error,
 };
 
-void Log(LogLevel level, const char* fmt, ...);
+// log messages are sorted into channels, each with its own minimum level.
+// by default only Info and above are shown. Debug messages are compiled out
+// entirely in release builds (NDEBUG), so they're fine on hot paths
+enum class LogChannel
+{
+    Core = 0,
+    Flash,
+    I2C,
+    Wifi,
+    IRQ,
+    DMA,
+
+    Count
+};
+
+extern std::atomic<u8> LogMinLevel[(int)LogChannel::Count];
+
+inline bool LogEnabled(LogChannel chan, LogLevel level)
+{
+#ifdef NDEBUG
+    if (level <= LogLevel::Debug)
+        return false;
+#endif
+    return level >= LogMinLevel[(int)chan].load(std::memory_order_relaxed);
+}
+
+void SetLogLevel(LogChannel chan, LogLevel level);
+// returns false if there's no channel by that name
+bool SetLogLevel(const char* channame, LogLevel level);
+
+// messages are queued and written out by a separate thread, so logging
+// doesn't hold up the emulator. if the queue fills up, messages are dropped
+// and counted. messages are cut at 255 characters
+void Log(LogLevel level, const char* fmt, ...) LOG_PRINTF(2, 3);
+void LogMsg(LogChannel chan, LogLevel level, const char* fmt, ...) LOG_PRINTF(3, 4);
+void LogHexMsg(LogChannel chan, LogLevel level, const u8* data, u32 len);
+
+template<typename... Args>
+inline void Log(LogChannel chan, LogLevel level, const char* fmt, Args... args)
+{
+    if (LogEnabled(chan, level))
+        LogMsg(chan, level, fmt, args...);
+}
+
+// hexdump, in lines of 32 bytes
+inline void LogHex(LogChannel chan, LogLevel level, const u8* data, u32 len)
+{
+    if (LogEnabled(chan, level))
+        LogHexMsg(chan, level, data, len);
+}
+
+// waits until everything logged so far has been written
+void FlushLog();
 
 
 }
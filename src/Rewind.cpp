@@ -0,0 +1,351 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "WUP.h"
+#include "Rewind.h"
+#include "Savestate.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+namespace Rewind
+{
+
+/*
+ * frames are saved as incremental states against a full base state, so they
+ * only contain the memory pages written since the base. when that grows past
+ * kRebaseSize, a new base is taken. bases are kept as long as a frame needs
+ * them.
+ *
+ * each frame in the history is stored as a delta which turns the state of
+ * the frame after it into its own state. delta format:
+ * u32 length of the resulting state
+ * then runs of:
+ * u32 number of unchanged bytes to skip
+ * u32 number of changed bytes
+ * changed bytes, XORed with the old ones
+ *
+ * consecutive frames mostly differ in a few registers and the pages the
+ * firmware is working on, so the deltas are small.
+ */
+
+const u32 kRebaseSize = 4*1024*1024;
+
+// in 8-byte words
+const u32 kSkipChunk = 32;
+
+struct Entry
+{
+    std::vector<u8> Delta;
+    Savestate* Base;
+};
+
+thread_local bool Enabled;
+thread_local u64 Budget;
+thread_local u64 Used;
+
+thread_local std::deque<Entry> History;
+thread_local std::deque<Savestate*> Bases;
+
+// the latest frame, stored as-is
+thread_local std::vector<u8> CurState;
+thread_local Savestate* CurBase;
+
+thread_local std::vector<u8> DeltaBuffer;
+
+
+bool Init()
+{
+    Enabled = false;
+    Budget = kDefaultBudget;
+    Used = 0;
+    CurBase = nullptr;
+    return true;
+}
+
+void DeInit()
+{
+    Reset();
+}
+
+void Reset()
+{
+    History.clear();
+    for (Savestate* base : Bases)
+        delete base;
+    Bases.clear();
+
+    CurState.clear();
+    CurState.shrink_to_fit();
+    CurBase = nullptr;
+
+    DeltaBuffer.clear();
+    DeltaBuffer.shrink_to_fit();
+
+    Used = 0;
+}
+
+void SetEnabled(bool enable, u64 budget)
+{
+    Reset();
+    Enabled = enable;
+    Budget = budget;
+}
+
+bool IsEnabled()
+{
+    return Enabled;
+}
+
+u32 NumFrames()
+{
+    return History.size();
+}
+
+u64 MemoryUsed()
+{
+    return Used;
+}
+
+
+void Put32(std::vector<u8>& out, u32 val)
+{
+    u8 tmp[4];
+    memcpy(tmp, &val, 4);
+    out.insert(out.end(), tmp, tmp+4);
+}
+
+void PutRun(std::vector<u8>& out, u32 skip, u8* cur, const u8* data, u32 len)
+{
+    Put32(out, skip);
+    Put32(out, len);
+
+    u32 pos = out.size();
+    out.resize(pos + len);
+    u8* dst = &out[pos];
+    for (u32 i = 0; i < len; i++)
+        dst[i] = cur[i] ^ data[i];
+
+    memcpy(cur, data, len);
+}
+
+// updates the current state to the new one, and builds the delta going back
+// to the old one. only the parts that changed are copied over
+void UpdateState(std::vector<u8>& out, std::vector<u8>& cur, const u8* data, u32 len)
+{
+    out.clear();
+    Put32(out, cur.size());
+
+    // compare 8 bytes at a time, the leftover is stored as one last run
+    // unchanged areas are skipped in bigger chunks first, which memcmp
+    // does much faster
+    u32 curlen = cur.size();
+    u32 common = std::min(curlen, len);
+    u32 numwords = common >> 3;
+    u32 last = 0;
+    u32 w = 0;
+    for (;;)
+    {
+        u64 a, b;
+
+        while ((w + kSkipChunk) <= numwords && !memcmp(&cur[w << 3], &data[w << 3], kSkipChunk << 3))
+            w += kSkipChunk;
+
+        while (w < numwords)
+        {
+            memcpy(&a, &cur[w << 3], 8);
+            memcpy(&b, &data[w << 3], 8);
+            if (a != b) break;
+            w++;
+        }
+        if (w == numwords) break;
+
+        u32 start = w;
+        while (w < numwords)
+        {
+            memcpy(&a, &cur[w << 3], 8);
+            memcpy(&b, &data[w << 3], 8);
+            if (a == b) break;
+            w++;
+        }
+
+        PutRun(out, (start << 3) - last, &cur[start << 3], &data[start << 3], (w - start) << 3);
+        last = w << 3;
+    }
+
+    u32 tail = numwords << 3;
+    if (tail < curlen)
+    {
+        Put32(out, tail - last);
+        Put32(out, curlen - tail);
+        for (u32 i = tail; i < curlen; i++)
+            out.push_back(cur[i] ^ ((i < len) ? data[i] : 0));
+    }
+
+    cur.resize(len);
+    if (tail < len)
+        memcpy(&cur[tail], &data[tail], len - tail);
+}
+
+void ApplyDelta(std::vector<u8>& state, const std::vector<u8>& delta)
+{
+    u32 len;
+    memcpy(&len, &delta[0], 4);
+
+    // anything past the old length starts out as zero
+    state.resize(len, 0);
+
+    u32 pos = 4;
+    u32 addr = 0;
+    while ((pos + 8) <= delta.size())
+    {
+        u32 skip, num;
+        memcpy(&skip, &delta[pos], 4);
+        memcpy(&num, &delta[pos+4], 4);
+        pos += 8;
+        addr += skip;
+
+        u8* dst = &state[addr];
+        const u8* src = &delta[pos];
+        for (u32 i = 0; i < num; i++)
+            dst[i] ^= src[i];
+
+        pos += num;
+        addr += num;
+    }
+}
+
+
+void FreeUnusedBases()
+{
+    // bases come in order, so the unused ones are either older than the
+    // oldest frame, or newer than the latest frame after rewinding
+    Savestate* oldest = History.empty() ? CurBase : History.front().Base;
+    while (!Bases.empty() && Bases.front() != oldest)
+    {
+        Used -= Bases.front()->GetLength();
+        delete Bases.front();
+        Bases.pop_front();
+    }
+    while (!Bases.empty() && Bases.back() != CurBase)
+    {
+        Used -= Bases.back()->GetLength();
+        delete Bases.back();
+        Bases.pop_back();
+    }
+}
+
+void CaptureFrame()
+{
+    if (!Enabled) return;
+
+    if (!CurBase || CurState.size() > kRebaseSize)
+    {
+        Savestate* base = new Savestate();
+        base->DirtyBit = WUP::Dirty_Rewind;
+        if (!WUP::DoSavestate(base))
+        {
+            Log(LogLevel::Error, "rewind: failed to save base state\n");
+            delete base;
+            return;
+        }
+
+        base->GetData();
+        Bases.push_back(base);
+        Used += base->GetLength();
+    }
+
+    Savestate state(Bases.back());
+    state.DirtyBit = WUP::Dirty_Rewind;
+    if (!WUP::DoSavestate(&state))
+    {
+        Log(LogLevel::Error, "rewind: failed to save state\n");
+        return;
+    }
+
+    const u8* data = state.GetData();
+    u32 len = state.GetLength();
+
+    Used -= CurState.size();
+    UpdateState(DeltaBuffer, CurState, data, len);
+    Used += CurState.size();
+
+    if (CurBase)
+    {
+        // the previous frame goes into the history
+        Entry entry;
+        entry.Delta.assign(DeltaBuffer.begin(), DeltaBuffer.end());
+        entry.Base = CurBase;
+        History.push_back(std::move(entry));
+        Used += DeltaBuffer.size();
+    }
+    CurBase = Bases.back();
+
+    while (Used > Budget && !History.empty())
+    {
+        Used -= History.front().Delta.size();
+        History.pop_front();
+    }
+
+    FreeUnusedBases();
+}
+
+bool RewindFrames(u32 num)
+{
+    if (!num || num > History.size())
+        return false;
+
+    std::vector<u8> state = CurState;
+    Savestate* base = CurBase;
+    for (u32 i = 0; i < num; i++)
+    {
+        ApplyDelta(state, History[History.size() - 1 - i].Delta);
+        base = History[History.size() - 1 - i].Base;
+    }
+
+    Savestate file(state.data(), state.size(), base);
+    file.DirtyBit = WUP::Dirty_Rewind;
+    if (file.Error || !WUP::DoSavestate(&file))
+    {
+        Log(LogLevel::Error, "rewind: failed to load state, history cleared\n");
+        Reset();
+        return false;
+    }
+
+    for (u32 i = 0; i < num; i++)
+    {
+        Used -= History.back().Delta.size();
+        History.pop_back();
+    }
+
+    Used -= CurState.size();
+    CurState.swap(state);
+    CurBase = base;
+    Used += CurState.size();
+
+    FreeUnusedBases();
+    return true;
+}
+
+}
@@ -0,0 +1,56 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "types.h"
+
+// history of the last frames, to be able to step backwards
+//
+// a state is taken at the end of every frame. only the latest one is kept
+// as-is, older ones are stored as compressed deltas going backwards, so
+// rewinding N frames means undoing N deltas and loading the result.
+
+namespace Rewind
+{
+
+const u64 kDefaultBudget = 256*1024*1024;
+
+bool Init();
+void DeInit();
+void Reset();
+
+// the history is cleared when rewinding is disabled or the budget changes
+void SetEnabled(bool enable, u64 budget = kDefaultBudget);
+bool IsEnabled();
+
+// called by WUP::RunFrame()
+void CaptureFrame();
+
+// number of frames that can be rewound
+u32 NumFrames();
+// memory used by the history, in bytes
+u64 MemoryUsed();
+
+// goes back the given number of frames. newer frames are dropped
+bool RewindFrames(u32 num);
+
+}
+
+#endif // REWIND_H
@@ -0,0 +1,159 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "WUP.h"
+#include "Flash.h"
+#include "FlashJournal.h"
+#include "RunAhead.h"
+#include "Savestate.h"
+#include "Platform.h"
+#include "ARMJIT.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+namespace RunAhead
+{
+
+thread_local u32 NumFrames;
+
+// memory as of the last time the state was saved
+thread_local u8* RAMCopy;
+thread_local u8* FlashCopy;
+thread_local bool CopyValid;
+
+
+bool Init()
+{
+    NumFrames = 0;
+    RAMCopy = nullptr;
+    FlashCopy = nullptr;
+    CopyValid = false;
+    return true;
+}
+
+void DeInit()
+{
+    SetFrames(0);
+}
+
+void Reset()
+{
+    CopyValid = false;
+}
+
+void SetFrames(u32 num)
+{
+    NumFrames = num;
+    CopyValid = false;
+
+    if (num && !RAMCopy)
+    {
+        RAMCopy = new u8[0x400000];
+        FlashCopy = new u8[Flash::kSize];
+    }
+    else if (!num && RAMCopy)
+    {
+        delete[] RAMCopy;
+        delete[] FlashCopy;
+        RAMCopy = nullptr;
+        FlashCopy = nullptr;
+    }
+}
+
+u32 GetFrames()
+{
+    return NumFrames;
+}
+
+
+void SaveMemory(u8* copy, const u8* mem, u8* dirty, u32 numpages)
+{
+    const u32 pagesize = 1 << WUP::kDirtyPageShift;
+
+    for (u32 i = 0; i < numpages; i++)
+    {
+        if (!(dirty[i] & WUP::Dirty_RunAhead))
+            continue;
+
+        u32 offset = i << WUP::kDirtyPageShift;
+        memcpy(&copy[offset], &mem[offset], pagesize);
+        dirty[i] &= ~WUP::Dirty_RunAhead;
+    }
+}
+
+void RestoreMemory(const u8* copy, u8* mem, u8* dirty, u32 numpages, bool code)
+{
+    const u32 pagesize = 1 << WUP::kDirtyPageShift;
+
+    for (u32 i = 0; i < numpages; i++)
+    {
+        if (!(dirty[i] & WUP::Dirty_RunAhead))
+            continue;
+
+        // the page still counts as written for everyone else
+        u32 offset = i << WUP::kDirtyPageShift;
+        memcpy(&mem[offset], &copy[offset], pagesize);
+        dirty[i] = WUP::Dirty_All & ~WUP::Dirty_RunAhead;
+
+        if (code)
+            ARMJIT::InvalidateRange(offset, pagesize);
+    }
+}
+
+void RunFrames()
+{
+    if (!NumFrames) return;
+
+    if (!CopyValid)
+    {
+        memset(WUP::MainRAMDirty, WUP::Dirty_All, WUP::kNumRAMDirtyPages);
+        memset(Flash::DirtyPages, WUP::Dirty_All, Flash::kNumDirtyPages);
+        CopyValid = true;
+    }
+
+    SaveMemory(RAMCopy, WUP::MainRAM, WUP::MainRAMDirty, WUP::kNumRAMDirtyPages);
+    SaveMemory(FlashCopy, Flash::Data, Flash::DirtyPages, Flash::kNumDirtyPages);
+
+    Savestate state(nullptr, false);
+    if (!WUP::DoSavestate(&state))
+    {
+        Log(LogLevel::Error, "run-ahead: failed to save state\n");
+        return;
+    }
+
+    for (u32 i = 0; i < NumFrames; i++)
+        WUP::EmulateFrame();
+
+    Savestate file(state.GetData(), state.GetLength());
+    if (file.Error || !WUP::DoSavestate(&file))
+    {
+        Log(LogLevel::Error, "run-ahead: failed to restore state\n");
+        return;
+    }
+
+    RestoreMemory(RAMCopy, WUP::MainRAM, WUP::MainRAMDirty, WUP::kNumRAMDirtyPages, true);
+    RestoreMemory(FlashCopy, Flash::Data, Flash::DirtyPages, Flash::kNumDirtyPages, false);
+
+    // whatever the flash got from these frames is gone
+    FlashJournal::DiscardFrame();
+}
+
+}
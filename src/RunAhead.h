@@ -0,0 +1,48 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+
+#include "types.h"
+
+// run-ahead, to hide the latency between input and its effect on screen
+//
+// after each frame, the state is saved, a few more frames are run with the
+// current input, and the state is restored. the framebuffer is left showing
+// the last frame run ahead.
+// main RAM and the flash are kept in a copy which is only updated for the
+// pages written since the last time, so saving and restoring stay cheap.
+
+namespace RunAhead
+{
+
+bool Init();
+void DeInit();
+void Reset();
+
+// 0 disables run-ahead
+void SetFrames(u32 num);
+u32 GetFrames();
+
+// called by WUP::RunFrame()
+void RunFrames();
+
+}
+
+#endif // RUNAHEAD_H
@@ -23,6 +23,7 @@
 #include "Wifi.h"
 #include "FIFO.h"
 #include "Platform.h"
+#include "ARMJIT.h"
 
 using Platform::Log;
 using Platform::LogLevel;
@@ -30,29 +31,29 @@ using Platform::LogLevel;
 namespace SDIO
 {
 
-u32 DMAAddr;
-u16 BlockSize;
-u16 BlockCount;
-u16 TransferMode;
-u16 CurBlock;
-bool Transferring;
+thread_local u32 DMAAddr;
+thread_local u16 BlockSize;
+thread_local u16 BlockCount;
+thread_local u16 TransferMode;
+thread_local u16 CurBlock;
+thread_local bool Transferring;
 
-u32 Arg;
-u16 Cmd;
-u16 Resp[8];
-FIFO<u8, 0x200> DataBuffer;
-u32 PresentState;
+thread_local u32 Arg;
+thread_local u16 Cmd;
+thread_local u16 Resp[8];
+thread_local FIFO<u8, 0x200> DataBuffer;
+thread_local u32 PresentState;
 
-u8 HostCnt;
+thread_local u8 HostCnt;
 //
-u16 ClockCnt;
+thread_local u16 ClockCnt;
 
-u16 IRQFlags;
-u16 ErrorIRQFlags;
-u16 IRQEnable;
-u16 ErrorIRQEnable;
-u16 IRQSignalEnable;
-u16 ErrorIRQSignalEnable;
+thread_local u16 IRQFlags;
+thread_local u16 ErrorIRQFlags;
+thread_local u16 IRQEnable;
+thread_local u16 ErrorIRQEnable;
+thread_local u16 IRQSignalEnable;
+thread_local u16 ErrorIRQSignalEnable;
 
 
 bool Init()
@@ -92,6 +93,34 @@ void Reset()
     ErrorIRQSignalEnable = 0;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("SDIO");
+
+    file->Var32(&DMAAddr);
+    file->Var16(&BlockSize);
+    file->Var16(&BlockCount);
+    file->Var16(&TransferMode);
+    file->Var16(&CurBlock);
+    file->Bool32(&Transferring);
+
+    file->Var32(&Arg);
+    file->Var16(&Cmd);
+    file->VarArray(Resp, sizeof(Resp));
+    DataBuffer.DoSavestate(file);
+    file->Var32(&PresentState);
+
+    file->Var8(&HostCnt);
+    file->Var16(&ClockCnt);
+
+    file->Var16(&IRQFlags);
+    file->Var16(&ErrorIRQFlags);
+    file->Var16(&IRQEnable);
+    file->Var16(&ErrorIRQEnable);
+    file->Var16(&IRQSignalEnable);
+    file->Var16(&ErrorIRQSignalEnable);
+}
+
 
 void SetIRQ(int irq)
 {
@@ -142,6 +171,9 @@ void RequestBlockRead()
         {
             Wifi::ReadBlock(tmp, BlockSize);
 
+            WUP::MarkRAMDirtyRange(DMAAddr, BlockSize);
+            ARMJIT::InvalidateRange(DMAAddr, BlockSize);
+
             for (int j = 0; j < BlockSize; j++)
             {
                 WUP::MainRAM[DMAAddr] = tmp[j];
@@ -20,6 +20,7 @@
 #define SDIO_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace SDIO
 {
@@ -55,6 +56,7 @@ enum
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void SetIRQ(int irq);
 void SetErrorIRQ(int irq);
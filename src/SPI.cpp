@@ -32,27 +32,29 @@ using Platform::LogLevel;
 namespace SPI
 {
 
-u32 ClockCnt;
-u32 Cnt;
-u32 IRQFlags;
-u32 Unk14;
-u32 IRQEnable;
-u32 ReadLength;
-u32 DeviceSel;
+thread_local u32 ClockCnt;
+thread_local u32 Cnt;
+thread_local u32 IRQFlags;
+thread_local u32 Unk14;
+thread_local u32 IRQEnable;
+thread_local u32 ReadLength;
+thread_local u32 DeviceSel;
 
-u32 GPIO_CS[2];
+thread_local u32 GPIO_CS[2];
 
-FIFO<u8, 16> WriteFIFO;
-FIFO<u8, 16> ReadFIFO;
+thread_local FIFO<u8, 16> WriteFIFO;
+thread_local FIFO<u8, 16> ReadFIFO;
 
-bool Busy;
-u8 ManualSel;
-u8 CurDevice;
-u32 ReadRemaining;
+thread_local bool Busy;
+thread_local u8 ManualSel;
+thread_local u8 CurDevice;
+thread_local u32 ReadRemaining;
 
 
 bool Init()
 {
+    WUP::RegisterEventFunc(OnWrite);
+    WUP::RegisterEventFunc(OnRead);
     return true;
 }
 
@@ -83,6 +85,30 @@ void Reset()
     ReadRemaining = 0;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("SPI.");
+
+    file->Var32(&ClockCnt);
+    file->Var32(&Cnt);
+    file->Var32(&IRQFlags);
+    file->Var32(&Unk14);
+    file->Var32(&IRQEnable);
+    file->Var32(&ReadLength);
+    file->Var32(&DeviceSel);
+
+    file->Var32(&GPIO_CS[0]);
+    file->Var32(&GPIO_CS[1]);
+
+    WriteFIFO.DoSavestate(file);
+    ReadFIFO.DoSavestate(file);
+
+    file->Bool32(&Busy);
+    file->Var8(&ManualSel);
+    file->Var8(&CurDevice);
+    file->Var32(&ReadRemaining);
+}
+
 
 void SetCnt(u32 val)
 {
@@ -20,6 +20,7 @@
 #define SPI_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace SPI
 {
@@ -27,6 +28,7 @@ namespace SPI
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void SetCnt(u32 val);
 void UpdateChipSelect();
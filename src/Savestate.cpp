@@ -0,0 +1,544 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <random>
+#include "Savestate.h"
+#include "Platform.h"
+
+using Platform::Log;
+using Platform::LogLevel;
+
+/*
+ * format:
+ *
+ * header
+ * 00 - magic 'PMSV'
+ * 04 - version major
+ * 06 - version minor
+ * 08 - total length
+ * 0C - reserved (0)
+ *
+ * section header
+ * 00 - magic
+ * 04 - section length, header included
+ * 08 - reserved (0)
+ * 0C - reserved (0)
+ *
+ * since 1.1, the first section is 'STID', with the ID of the state and the
+ * ID of its base (0 if it's a full state)
+ * since 1.2, it's followed by flags:
+ * bit 0 - memory is left out
+ *
+ * dirty array section
+ * 00 - array length
+ * 04 - page shift
+ * 08 - 0 = full array follows
+ *      1 = incremental: one byte per page, nonzero if the page is stored,
+ *          then the stored pages
+ */
+
+const u32 kHeaderSize = 0x10;
+
+const u8 Dirty_Savestate = (1<<0);
+const u8 Dirty_All = 0xFF;
+const u32 kSectionHeaderSize = 0x10;
+
+// enough for main RAM and the flash in one go
+const u32 kInitialSize = 40*1024*1024;
+// incremental states are expected to be much smaller
+const u32 kInitialSizeIncremental = 1*1024*1024;
+
+
+u64 NewStateID()
+{
+    static thread_local std::mt19937_64 rng(((u64)std::random_device()() << 32) ^ (u64)time(nullptr));
+
+    u64 ret;
+    do
+    {
+        ret = rng();
+    }
+    while (!ret);
+    return ret;
+}
+
+
+Savestate::Savestate(Savestate* base, bool withmemory)
+{
+    Error = false;
+    Saving = true;
+    VersionMajor = SAVESTATE_MAJOR;
+    VersionMinor = SAVESTATE_MINOR;
+
+    StateID = NewStateID();
+    BaseID = 0;
+    Base = base;
+    DirtyBit = Dirty_Savestate;
+    DirtyTracked = false;
+    WithMemory = withmemory;
+
+    if (Base)
+    {
+        // make sure the base is complete before it's used
+        Base->GetData();
+        BaseID = Base->StateID;
+        if (Base->Error || Base->BaseID || !Base->WithMemory)
+        {
+            Log(LogLevel::Error, "savestate: the base has to be a valid full state\n");
+            Error = true;
+        }
+    }
+
+    BufferLength = (Base || !WithMemory) ? kInitialSizeIncremental : kInitialSize;
+    Buffer = (u8*)malloc(BufferLength);
+    OwnsBuffer = true;
+
+    memset(Buffer, 0, kHeaderSize);
+    memcpy(&Buffer[0x00], "PMSV", 4);
+    *(u16*)&Buffer[0x04] = SAVESTATE_MAJOR;
+    *(u16*)&Buffer[0x06] = SAVESTATE_MINOR;
+
+    Pos = kHeaderSize;
+    CurSection = 0;
+    SectionEnd = 0;
+
+    u32 flags = WithMemory ? 0 : (1<<0);
+    Section("STID");
+    Var64(&StateID);
+    Var64(&BaseID);
+    Var32(&flags);
+}
+
+Savestate::Savestate(const u8* data, u32 len, Savestate* base)
+{
+    Error = false;
+    Saving = false;
+    VersionMajor = 0;
+    VersionMinor = 0;
+
+    StateID = 0;
+    BaseID = 0;
+    Base = nullptr;
+    DirtyBit = Dirty_Savestate;
+    DirtyTracked = false;
+    WithMemory = true;
+
+    Buffer = (u8*)data;
+    BufferLength = len;
+    OwnsBuffer = false;
+
+    Pos = kHeaderSize;
+    CurSection = 0;
+    SectionEnd = 0;
+
+    if (len < kHeaderSize || memcmp(&Buffer[0x00], "PMSV", 4))
+    {
+        Log(LogLevel::Error, "savestate: invalid header\n");
+        Error = true;
+        return;
+    }
+
+    VersionMajor = *(u16*)&Buffer[0x04];
+    VersionMinor = *(u16*)&Buffer[0x06];
+    if (VersionMajor != SAVESTATE_MAJOR)
+    {
+        Log(LogLevel::Error, "savestate: bad version major %d, expecting %d\n", VersionMajor, SAVESTATE_MAJOR);
+        Error = true;
+        return;
+    }
+    if (VersionMinor > SAVESTATE_MINOR)
+    {
+        Log(LogLevel::Error, "savestate: state from the future, %d > %d\n", VersionMinor, SAVESTATE_MINOR);
+        Error = true;
+        return;
+    }
+
+    u32 total = *(u32*)&Buffer[0x08];
+    if (total > len)
+    {
+        Log(LogLevel::Error, "savestate: truncated, %d bytes out of %d\n", len, total);
+        Error = true;
+        return;
+    }
+    BufferLength = total;
+
+    if (!IsAtleastVersion(1, 1))
+        return;
+
+    Section("STID");
+    Var64(&StateID);
+    Var64(&BaseID);
+
+    if (IsAtleastVersion(1, 2))
+    {
+        u32 flags;
+        Var32(&flags);
+        WithMemory = !(flags & (1<<0));
+    }
+
+    if (BaseID)
+    {
+        if (!base || base->StateID != BaseID)
+        {
+            Log(LogLevel::Error, "savestate: state is incremental and its base is %s\n", base ? "wrong" : "missing");
+            Error = true;
+            return;
+        }
+
+        Base = base;
+        Base->GetData();
+    }
+}
+
+Savestate::~Savestate()
+{
+    if (OwnsBuffer)
+        free(Buffer);
+}
+
+
+void Savestate::Grow(u32 len)
+{
+    u32 newlen = BufferLength;
+    while ((Pos + len) > newlen)
+        newlen *= 2;
+    if (newlen == BufferLength)
+        return;
+
+    Buffer = (u8*)realloc(Buffer, newlen);
+    BufferLength = newlen;
+}
+
+void Savestate::FinishSection()
+{
+    if (!CurSection) return;
+
+    *(u32*)&Buffer[CurSection + 0x04] = Pos - CurSection;
+    CurSection = 0;
+}
+
+void Savestate::Section(const char* magic)
+{
+    if (Error) return;
+
+    if (Saving)
+    {
+        FinishSection();
+
+        Grow(kSectionHeaderSize);
+        CurSection = Pos;
+        memset(&Buffer[Pos], 0, kSectionHeaderSize);
+        memcpy(&Buffer[Pos], magic, 4);
+        Pos += kSectionHeaderSize;
+    }
+    else
+    {
+        u32 pos = kHeaderSize;
+        while ((pos + kSectionHeaderSize) <= BufferLength)
+        {
+            u32 len = *(u32*)&Buffer[pos + 0x04];
+            if (len < kSectionHeaderSize || (pos + len) > BufferLength)
+                break;
+
+            if (!memcmp(&Buffer[pos], magic, 4))
+            {
+                Pos = pos + kSectionHeaderSize;
+                SectionEnd = pos + len;
+                return;
+            }
+
+            pos += len;
+        }
+
+        Log(LogLevel::Error, "savestate: section %c%c%c%c not found\n", magic[0], magic[1], magic[2], magic[3]);
+        Error = true;
+    }
+}
+
+const u8* Savestate::FindSection(const char* magic, u32* len)
+{
+    u32 end = Saving ? Pos : BufferLength;
+    u32 pos = kHeaderSize;
+    while ((pos + kSectionHeaderSize) <= end)
+    {
+        u32 seclen = *(u32*)&Buffer[pos + 0x04];
+        if (seclen < kSectionHeaderSize || (pos + seclen) > end)
+            break;
+
+        if (!memcmp(&Buffer[pos], magic, 4))
+        {
+            *len = seclen - kSectionHeaderSize;
+            return &Buffer[pos + kSectionHeaderSize];
+        }
+
+        pos += seclen;
+    }
+
+    return nullptr;
+}
+
+void Savestate::Bool32(bool* var)
+{
+    // for compatibility
+    if (Saving)
+    {
+        u32 val = *var;
+        Var32(&val);
+    }
+    else
+    {
+        u32 val = 0;
+        Var32(&val);
+        *var = val != 0;
+    }
+}
+
+void Savestate::VarArray(void* data, u32 len)
+{
+    if (Error) return;
+
+    if (Saving)
+    {
+        Grow(len);
+        memcpy(&Buffer[Pos], data, len);
+    }
+    else
+    {
+        if ((Pos + len) > SectionEnd)
+        {
+            Log(LogLevel::Error, "savestate: read past the end of the section\n");
+            Error = true;
+            return;
+        }
+
+        memcpy(data, &Buffer[Pos], len);
+    }
+
+    Pos += len;
+}
+
+void Savestate::DirtyArray(const char* magic, u8* data, u32 len, u8* dirty, u8 dirtybit, u32 pageshift)
+{
+    if (!WithMemory) return;
+
+    Section(magic);
+    if (Error) return;
+
+    u32 pagesize = 1 << pageshift;
+    u32 numpages = len >> pageshift;
+    u32 incremental;
+
+    if (Saving)
+    {
+        incremental = (Base && DirtyTracked) ? 1 : 0;
+        Var32(&len);
+        Var32(&pageshift);
+        Var32(&incremental);
+
+        if (incremental)
+        {
+            u32 pos = Pos;
+            Grow(numpages);
+            for (u32 i = 0; i < numpages; i++)
+                Buffer[pos + i] = (dirty[i] & dirtybit) ? 1 : 0;
+            Pos += numpages;
+
+            for (u32 i = 0; i < numpages; i++)
+            {
+                if (dirty[i] & dirtybit)
+                    VarArray(&data[i << pageshift], pagesize);
+            }
+        }
+        else
+        {
+            VarArray(data, len);
+
+            // this is the new base
+            if (!Base)
+            {
+                for (u32 i = 0; i < numpages; i++)
+                    dirty[i] &= ~dirtybit;
+            }
+        }
+
+        return;
+    }
+
+    u32 srclen, srcshift;
+    Var32(&srclen);
+    Var32(&srcshift);
+    Var32(&incremental);
+    if (Error) return;
+    if (srclen != len || srcshift != pageshift)
+    {
+        Log(LogLevel::Error, "savestate: bad array in section %c%c%c%c\n", magic[0], magic[1], magic[2], magic[3]);
+        Error = true;
+        return;
+    }
+
+    if (!incremental)
+    {
+        if ((Pos + len) > SectionEnd)
+        {
+            Log(LogLevel::Error, "savestate: read past the end of the section\n");
+            Error = true;
+            return;
+        }
+
+        // pages which are copied count as written for the other users of
+        // the dirty map. a full array within an incremental state can't be
+        // tracked, otherwise this is the new base
+        bool all = Base || !DirtyTracked;
+        for (u32 i = 0; i < numpages; i++)
+        {
+            if (all || (dirty[i] & dirtybit))
+            {
+                // if restoring the state we're tracking against, only what
+                // was written since then has to be copied back. pages that
+                // are the same don't count as written
+                u8* dst = &data[i << pageshift];
+                const u8* src = &Buffer[Pos + (i << pageshift)];
+                if (memcmp(dst, src, pagesize))
+                {
+                    memcpy(dst, src, pagesize);
+                    dirty[i] = Dirty_All;
+                }
+            }
+
+            if (!Base) dirty[i] &= ~dirtybit;
+        }
+        Pos += len;
+        return;
+    }
+
+    u32 baselen = 0;
+    const u8* basedata = Base ? Base->FindSection(magic, &baselen) : nullptr;
+    if (!basedata || baselen < (12 + len) || *(u32*)&basedata[8])
+    {
+        Log(LogLevel::Error, "savestate: section %c%c%c%c missing from the base\n", magic[0], magic[1], magic[2], magic[3]);
+        Error = true;
+        return;
+    }
+    basedata += 12;
+
+    if ((Pos + numpages) > SectionEnd)
+    {
+        Log(LogLevel::Error, "savestate: read past the end of the section\n");
+        Error = true;
+        return;
+    }
+    const u8* stored = &Buffer[Pos];
+    Pos += numpages;
+
+    u32 numstored = 0;
+    for (u32 i = 0; i < numpages; i++)
+    {
+        if (stored[i]) numstored++;
+    }
+    if ((Pos + (numstored << pageshift)) > SectionEnd)
+    {
+        Log(LogLevel::Error, "savestate: read past the end of the section\n");
+        Error = true;
+        return;
+    }
+
+    // pages that were written since the base are restored from the base,
+    // unless this state has them
+    for (u32 i = 0; i < numpages; i++)
+    {
+        u32 offset = i << pageshift;
+
+        if (stored[i])
+        {
+            memcpy(&data[offset], &Buffer[Pos], pagesize);
+            Pos += pagesize;
+            dirty[i] = Dirty_All;
+        }
+        else if ((dirty[i] & dirtybit) || !DirtyTracked)
+        {
+            memcpy(&data[offset], &basedata[offset], pagesize);
+            dirty[i] = Dirty_All & ~dirtybit;
+        }
+    }
+}
+
+
+const u8* Savestate::GetData()
+{
+    if (Saving)
+    {
+        FinishSection();
+        *(u32*)&Buffer[0x08] = Pos;
+    }
+
+    return Buffer;
+}
+
+u32 Savestate::GetLength()
+{
+    return Saving ? Pos : BufferLength;
+}
+
+bool Savestate::SaveToFile(const char* filename)
+{
+    if (Error) return false;
+
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "savestate: failed to open %s\n", filename);
+        return false;
+    }
+
+    const u8* data = GetData();
+    u32 len = GetLength();
+    bool ret = fwrite(data, len, 1, f) == 1;
+    fclose(f);
+    return ret;
+}
+
+Savestate* Savestate::LoadFromFile(const char* filename, Savestate* base)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+    {
+        Log(LogLevel::Error, "savestate: failed to open %s\n", filename);
+        return nullptr;
+    }
+
+    fseek(f, 0, SEEK_END);
+    u32 len = (u32)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    u8* data = (u8*)malloc(len ? len : 1);
+    if (fread(data, len, 1, f) != 1)
+    {
+        fclose(f);
+        free(data);
+        return nullptr;
+    }
+    fclose(f);
+
+    Savestate* ret = new Savestate(data, len, base);
+    ret->OwnsBuffer = true;
+    return ret;
+}
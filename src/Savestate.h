@@ -0,0 +1,116 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include "types.h"
+
+#define SAVESTATE_MAJOR 1
+#define SAVESTATE_MINOR 2
+
+// savestates are built and read entirely in memory, so that taking and
+// restoring snapshots is only a matter of copying data around.
+// the layout is a header followed by tagged sections. sections are looked
+// up by tag when loading, so they don't have to come in any given order.
+//
+// large memory arrays can be stored incrementally, against a base state:
+// only the pages marked dirty since the base are stored, and the rest is
+// fetched from the base when loading. the base has to be a full state, and
+// has to be kept around as long as states depending on it.
+
+class Savestate
+{
+public:
+    // creates an empty state for saving, optionally against a base state
+    // a state without memory leaves out everything stored with DirtyArray(),
+    // for callers which keep track of memory on their own
+    Savestate(Savestate* base = nullptr, bool withmemory = true);
+    // loads from the given data, which must stay around as long as the state
+    // the base is required if the state was saved against one
+    Savestate(const u8* data, u32 len, Savestate* base = nullptr);
+    ~Savestate();
+
+    bool Error;
+
+    bool Saving;
+    u32 VersionMajor;
+    u32 VersionMinor;
+
+    // unique ID of a full state, or of the base of an incremental state
+    u64 StateID;
+    u64 BaseID;
+    Savestate* Base;
+
+    bool WithMemory;
+
+    // which user of the dirty page maps this state belongs to, so that
+    // several users can each track memory against their own base.
+    // savestates by default, see WUP::Dirty_Savestate
+    u8 DirtyBit;
+
+    // set when the dirty page maps passed to DirtyArray() are relative to
+    // the base (or to this state, for a full state being loaded)
+    bool DirtyTracked;
+
+    void Section(const char* magic);
+
+    void Var8(u8* var) { VarArray(var, sizeof(u8)); }
+    void Var16(u16* var) { VarArray(var, sizeof(u16)); }
+    void Var32(u32* var) { VarArray(var, sizeof(u32)); }
+    void Var64(u64* var) { VarArray(var, sizeof(u64)); }
+
+    void Bool32(bool* var);
+
+    void VarArray(void* data, u32 len);
+
+    // stores an array in its own section, only saving the pages marked in
+    // the dirty map when possible. dirty map entries have one bit per user,
+    // the given bit is updated to be relative to the base state afterwards,
+    // and pages changed by loading get all the other bits set
+    void DirtyArray(const char* magic, u8* data, u32 len, u8* dirty, u8 dirtybit, u32 pageshift);
+
+    bool IsAtleastVersion(u32 major, u32 minor)
+    {
+        if (VersionMajor > major) return true;
+        if (VersionMajor == major && VersionMinor >= minor) return true;
+        return false;
+    }
+
+    // finishes a state being saved and returns its contents
+    const u8* GetData();
+    u32 GetLength();
+
+    bool SaveToFile(const char* filename);
+    static Savestate* LoadFromFile(const char* filename, Savestate* base = nullptr);
+
+private:
+    u8* Buffer;
+    u32 BufferLength;
+    bool OwnsBuffer;
+
+    u32 Pos;
+    u32 CurSection;
+    u32 SectionEnd;
+
+    void FinishSection();
+    void Grow(u32 len);
+    const u8* FindSection(const char* magic, u32* len);
+};
+
+#endif // SAVESTATE_H
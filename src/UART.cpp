@@ -28,7 +28,7 @@ using Platform::LogLevel;
 namespace UART
 {
 
-bool datain;
+thread_local bool datain;
 
 
 bool Init()
@@ -45,6 +45,13 @@ void Reset()
     datain = false;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("UART");
+
+    file->Bool32(&datain);
+}
+
 
 void hax(u32 param)
 {
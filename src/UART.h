@@ -20,6 +20,7 @@
 #define UART_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace UART
 {
@@ -27,6 +28,7 @@ namespace UART
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 u32 Read(u32 addr);
 void Write(u32 addr, u32 val);
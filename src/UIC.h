@@ -20,6 +20,7 @@
 #define UIC_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace UIC
 {
@@ -27,11 +28,24 @@ namespace UIC
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void SetKeyMask(u32 mask);
 void SetTouchCoords(bool touching, int x, int y);
 void SetVolume(u8 vol);
 
+// input as seen by the firmware, for movies
+struct InputState
+{
+    u32 KeyMask;
+    bool Touching;
+    u16 TouchX, TouchY;
+    u8 Volume;
+};
+
+void GetInputState(InputState* state);
+void SetInputState(const InputState* state);
+
 void Select();
 void Release();
 u8 Read();
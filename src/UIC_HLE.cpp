@@ -28,25 +28,25 @@ using Platform::LogLevel;
 namespace UIC
 {
 
-u8 Cmd;
-u32 ByteCount;
+thread_local u8 Cmd;
+thread_local u32 ByteCount;
 
-u32 CurAddr;
+thread_local u32 CurAddr;
 
-u8 AccessSize;
+thread_local u8 AccessSize;
 
 const u8 FWVersion[4] = {0x28, 0x00, 0x00, 0x58};
 
-u8 EEPROM[0x700];
+thread_local u8 EEPROM[0x700];
 
-u8 InputData[0x80];
-u8 InputSeq;
+thread_local u8 InputData[0x80];
+thread_local u8 InputSeq;
 
 // input stuff
-u32 KeyMask;
-bool Touching;
-u16 TouchX, TouchY;
-u8 Volume;
+thread_local u32 KeyMask;
+thread_local bool Touching;
+thread_local u16 TouchX, TouchY;
+thread_local u8 Volume;
 
 
 u16 CRC16(u8* data, u32 len)
@@ -140,6 +140,27 @@ void Reset()
     Volume = 255;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("UIC.");
+
+    file->Var8(&Cmd);
+    file->Var32(&ByteCount);
+    file->Var32(&CurAddr);
+    file->Var8(&AccessSize);
+
+    file->VarArray(EEPROM, sizeof(EEPROM));
+
+    file->VarArray(InputData, sizeof(InputData));
+    file->Var8(&InputSeq);
+
+    file->Var32(&KeyMask);
+    file->Bool32(&Touching);
+    file->Var16(&TouchX);
+    file->Var16(&TouchY);
+    file->Var8(&Volume);
+}
+
 
 void SetKeyMask(u32 mask)
 {
@@ -172,9 +193,30 @@ void SetVolume(u8 vol)
     printf("VOLUME = %d\n", vol);
 }
 
+void GetInputState(InputState* state)
+{
+    state->KeyMask = KeyMask;
+    state->Touching = Touching;
+    state->TouchX = TouchX;
+    state->TouchY = TouchY;
+    state->Volume = Volume;
+}
+
+void SetInputState(const InputState* state)
+{
+    KeyMask = state->KeyMask;
+    Touching = state->Touching;
+    TouchX = state->TouchX;
+    TouchY = state->TouchY;
+    Volume = state->Volume;
+}
+
 
 void PrepareInputData()
 {
+    // the firmware is polling input, so this isn't a lag frame
+    WUP::LagFrameFlag = false;
+
     InputData[0] = FWVersion[0];
     InputData[1] = InputSeq++;
     InputData[127] = ~InputData[0];
@@ -31,20 +31,20 @@ namespace Video
 const int kWidth = 854;
 const int kHeight = 480;
 
-u32* Framebuffer;
+thread_local u32* Framebuffer;
 
-u32 FBXOffset;
-u32 FBWidth;
-u32 FBYOffset;
-u32 FBHeight;
-u32 FBStride;
-u32 FBAddr;
+thread_local u32 FBXOffset;
+thread_local u32 FBWidth;
+thread_local u32 FBYOffset;
+thread_local u32 FBHeight;
+thread_local u32 FBStride;
+thread_local u32 FBAddr;
 
-u32 DisplayCnt;
-u32 PixelFormat;
+thread_local u32 DisplayCnt;
+thread_local u32 PixelFormat;
 
-u32 PaletteAddr;
-u32 Palette[256];
+thread_local u32 PaletteAddr;
+thread_local u32 Palette[256];
 
 
 bool Init()
@@ -78,6 +78,26 @@ void Reset()
     memset(Palette, 0, sizeof(Palette));
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("VID.");
+
+    // the framebuffer itself is rendered from scratch every frame
+
+    file->Var32(&FBXOffset);
+    file->Var32(&FBWidth);
+    file->Var32(&FBYOffset);
+    file->Var32(&FBHeight);
+    file->Var32(&FBStride);
+    file->Var32(&FBAddr);
+
+    file->Var32(&DisplayCnt);
+    file->Var32(&PixelFormat);
+
+    file->Var32(&PaletteAddr);
+    file->VarArray(Palette, sizeof(Palette));
+}
+
 
 void RenderFrame()
 {
@@ -20,6 +20,7 @@
 #define VIDEO_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace Video
 {
@@ -27,6 +28,7 @@ namespace Video
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void RenderFrame();
 u32* GetFramebuffer();
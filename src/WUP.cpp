@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <vector>
 #include "WUP.h"
 #include "ARM.h"
 #include "DMA.h"
@@ -35,71 +36,134 @@
 #include "SDIO.h"
 #include "Wifi.h"
 #include "Platform.h"
+#include "ARMJIT.h"
+#include "Savestate.h"
+#include "Rewind.h"
+#include "Movie.h"
+#include "RunAhead.h"
+#include "FlashJournal.h"
+#ifdef JIT_ENABLED
+#include "ARMJIT_Memory.h"
+#endif
 
 using Platform::Log;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 
 namespace WUP
 {
 
-u8 ARM9MemTimings[0x40000][8];
-u32 ARM9Regions[0x40000];
+// bus timings, see SetARM9RegionTimings(). those are small enough to live in
+// thread-local storage directly
+thread_local RegionTimings ARM9Timings[kMaxTimingRegions];
+thread_local u32 NumTimingRegions;
+thread_local u8 ARM9TimingMap[kNumPages];
 
-ARMv5* ARM9;
+thread_local ARMv5* ARM9;
 
-u32 NumFrames;
-u32 NumLagFrames;
-bool LagFrameFlag;
-u64 LastSysClockCycles;
-u64 FrameStartTimestamp;
+thread_local u32 NumFrames;
+thread_local u32 NumLagFrames;
+thread_local bool LagFrameFlag;
+thread_local u64 LastSysClockCycles;
+thread_local u64 FrameStartTimestamp;
 
-const s32 kMaxIterationCycles = 64;
-const s32 kIterationCycleMargin = 8;
+// number of times the CPU was run during the last frame
+thread_local u32 NumFrameSlices;
+
+// only one frame out of every RenderInterval gets drawn
+thread_local u32 RenderInterval;
+thread_local u32 RenderCounter;
+thread_local bool FrameRendered;
 
 
 // no need to worry about those overflowing, they can keep going for atleast 4350 years
-u64 ARM9Timestamp, ARM9Target;
-u64 SysTimestamp;
+thread_local u64 ARM9Timestamp, ARM9Target;
+thread_local u64 SysTimestamp;
+
+// events are kept in a binary heap ordered by timestamp, so the next one
+// is always at the top
+thread_local std::vector<SchedEvent> SchedList;
+thread_local std::vector<u32> SchedHeap;
+thread_local std::vector<void (*)(u32)> EventFuncs;
+
+thread_local u8* MainRAM;
+thread_local u8 MainRAMDirty[kNumRAMDirtyPages];
 
-SchedEvent SchedList[Event_MAX];
-u32 SchedListMask;
+// ID of the state the dirty page maps are relative to, 0 if none. savestates
+// and rewind each keep their own
+thread_local u64 SavestateBase;
+thread_local u64 RewindBase;
 
-u8 MainRAM[0x400000];
+thread_local u8* ARM9PageMap[kNumPages];
+thread_local const MemHandlers* ARM9PageHandlers[kNumPages];
 
-u32 SoftResetReg;
+thread_local u32 SoftResetReg;
 
+thread_local int CPUMode;
 
-u8 IRQEnable[0x28];
-u64 IRQMask;
-u32 CurrentIRQ;
-u32 IRQPriority;
-u32 LastIRQPriority;
 
+thread_local u8 IRQEnable[0x28];
+thread_local u64 IRQMask;
+thread_local u32 CurrentIRQ;
+thread_local u32 IRQPriority;
+thread_local u32 LastIRQPriority;
 
-u64 TimerTimestamp;
+
+// timers aren't ticked as the CPU runs. instead they're brought up to date
+// when they're accessed, and a scheduler event is kept for the next time each
+// timer reaches its target (see ScheduleTimerEvent())
+thread_local u64 TimerTimestamp;
 
 // 0 = timer 0/1, 1 = count-up
-u32 TimerPrescaler[2];
-u32 TimerCounter[2];
+thread_local u32 TimerPrescaler[2];
+thread_local u32 TimerCounter[2];
+
+thread_local u32 CountUpVal;
+
+thread_local u32 TimerCnt[2];
+thread_local u32 TimerTarget[2];
+thread_local u32 TimerVal[2];
+thread_local u32 TimerSubCounter[2];
 
-u32 CountUpVal;
+thread_local bool TimersPolled;
 
-u32 TimerCnt[2];
-u32 TimerTarget[2];
-u32 TimerVal[2];
-u32 TimerSubCounter[2];
+thread_local bool Running;
 
-bool Running;
 
+void InitPageMap();
+void ScheduleTimerEvent(int timer);
+void TimerEvent(u32 timer);
 
 bool Init()
 {
     ARM9 = new ARMv5();
 
+    SchedList.resize(Event_MAX);
+    for (SchedEvent& evt : SchedList)
+        evt.HeapIndex = -1;
+
+    RegisterEventFunc(TimerEvent);
+
+#ifdef JIT_ENABLED
+    MainRAM = ARMJIT_Memory::AllocMainRAM();
+#else
+    MainRAM = new u8[0x400000];
+#endif
+
+    InitPageMap();
+
+    if (!ARMJIT::Init()) return false;
+    CPUMode = ARMJIT::SetNative(true) ? CPUMode_JIT : CPUMode_CachedInterpreter;
+
+    RenderInterval = 1;
+    RenderCounter = 0;
+    FrameRendered = true;
+
     if (!DMA::Init()) return false;
 
     if (!Flash::Init()) return false;
+    if (!FlashJournal::Init()) return false;
     if (!UIC::Init()) return false;
     if (!SPI::Init()) return false;
 
@@ -116,11 +180,19 @@ bool Init()
     if (!SDIO::Init()) return false;
     if (!Wifi::Init()) return false;
 
+    if (!Rewind::Init()) return false;
+    if (!Movie::Init()) return false;
+    if (!RunAhead::Init()) return false;
+
     return true;
 }
 
 void DeInit()
 {
+    RunAhead::DeInit();
+    Movie::DeInit();
+    Rewind::DeInit();
+
     Wifi::DeInit();
     SDIO::DeInit();
 
@@ -135,19 +207,77 @@ void DeInit()
     UART::DeInit();
 
     SPI::DeInit();
+    FlashJournal::DeInit();
     Flash::DeInit();
     UIC::DeInit();
 
     DMA::DeInit();
 
+    ARMJIT::DeInit();
+
+#ifdef JIT_ENABLED
+    ARMJIT_Memory::FreeMainRAM(MainRAM);
+#else
+    delete[] MainRAM;
+#endif
+    MainRAM = NULL;
+
     delete ARM9;
+
+    SchedList.clear();
+    SchedHeap.clear();
+    EventFuncs.clear();
 }
 
 
+// returns the descriptor for these timings, adding it if needed. pages in
+// the given range are about to be changed, they don't count as using theirs
+int GetTimingRegion(const RegionTimings& timings, u32 pagestart, u32 pageend)
+{
+    for (u32 i = 0; i < NumTimingRegions; i++)
+    {
+        if (!memcmp(&ARM9Timings[i], &timings, sizeof(timings)))
+            return i;
+    }
+
+    if (NumTimingRegions == kMaxTimingRegions)
+    {
+        // drop the descriptors nothing uses anymore
+        bool used[kMaxTimingRegions] = {};
+        for (u32 i = 0; i < kNumPages; i++)
+        {
+            if (i < pagestart || i >= pageend)
+                used[ARM9TimingMap[i]] = true;
+        }
+
+        u8 remap[kMaxTimingRegions];
+        u32 num = 0;
+        for (u32 i = 0; i < kMaxTimingRegions; i++)
+        {
+            if (!used[i]) continue;
+            ARM9Timings[num] = ARM9Timings[i];
+            remap[i] = num++;
+        }
+        for (u32 i = 0; i < kNumPages; i++)
+        {
+            if (i < pagestart || i >= pageend)
+                ARM9TimingMap[i] = remap[ARM9TimingMap[i]];
+        }
+        NumTimingRegions = num;
+
+        if (NumTimingRegions == kMaxTimingRegions)
+            return -1;
+    }
+
+    ARM9Timings[NumTimingRegions] = timings;
+    return NumTimingRegions++;
+}
+
 void SetARM9RegionTimings(u32 addrstart, u32 addrend, u32 region, int buswidth, int nonseq, int seq)
 {
-    addrstart >>= 2;
-    addrend   >>= 2;
+    const u32 shift = kPageShift - 12;
+    u32 pagestart = addrstart >> shift;
+    u32 pageend = (addrend + (1 << shift) - 1) >> shift;
 
     int N16, S16, N32, S32, cpuN;
     N16 = nonseq;
@@ -166,30 +296,39 @@ void SetARM9RegionTimings(u32 addrstart, u32 addrend, u32 region, int buswidth,
     // nonseq accesses on the CPU get a 3-cycle penalty for all regions except main RAM
     cpuN = (region == Mem9_MainRAM) ? 0 : 3;
 
-    for (u32 i = addrstart; i < addrend; i++)
+    RegionTimings timings;
+
+    // CPU timings
+    timings.CPU[0] = N16 + cpuN;
+    timings.CPU[1] = S16;
+    timings.CPU[2] = N32 + cpuN;
+    timings.CPU[3] = S32;
+
+    // DMA timings
+    timings.DMA[0] = N16;
+    timings.DMA[1] = S16;
+    timings.DMA[2] = N32;
+    timings.DMA[3] = S32;
+
+    timings.Region = region;
+
+    int id = GetTimingRegion(timings, pagestart, pageend);
+    if (id < 0)
     {
-        // CPU timings
-        ARM9MemTimings[i][0] = N16 + cpuN;
-        ARM9MemTimings[i][1] = S16;
-        ARM9MemTimings[i][2] = N32 + cpuN;
-        ARM9MemTimings[i][3] = S32;
-
-        // DMA timings
-        ARM9MemTimings[i][4] = N16;
-        ARM9MemTimings[i][5] = S16;
-        ARM9MemTimings[i][6] = N32;
-        ARM9MemTimings[i][7] = S32;
-
-        ARM9Regions[i] = region;
+        Log(LogLevel::Error, "too many different region timings\n");
+        return;
     }
 
-    ARM9->UpdateRegionTimings(addrstart<<2, addrend<<2);
+    memset(&ARM9TimingMap[pagestart], id, pageend - pagestart);
+
+    ARM9->UpdateRegionTimings(pagestart, pageend);
 }
 
 void InitTimings()
 {
     // TODO!
 
+    NumTimingRegions = 0;
     SetARM9RegionTimings(0x00000, 0x100000, 0, 32, 1, 1); // void
 
     //
@@ -210,8 +349,11 @@ void Reset()
     InitTimings();
 
     memset(MainRAM, 0, 0x400000);
+    MarkRAMDirtyRange(0, 0x400000);
     SoftResetReg = 1;
 
+    ARMJIT::Reset();
+
     ARM9->Reset();
 
     memset(IRQEnable, 0, sizeof(IRQEnable));
@@ -228,14 +370,20 @@ void Reset()
     TimerCnt[0] = 0;
     TimerTarget[0] = 0;
     TimerVal[0] = 0;
-    TimerCounter[0] = 0;
+    TimerSubCounter[0] = 0;
     TimerCnt[1] = 0;
     TimerTarget[1] = 0;
     TimerVal[1] = 0;
-    TimerCounter[1] = 0;
+    TimerSubCounter[1] = 0;
 
-    memset(SchedList, 0, sizeof(SchedList));
-    SchedListMask = 0;
+    for (SchedEvent& evt : SchedList)
+    {
+        evt.Func = nullptr;
+        evt.Timestamp = 0;
+        evt.Param = 0;
+        evt.HeapIndex = -1;
+    }
+    SchedHeap.clear();
 
     DMA::Reset();
 
@@ -255,6 +403,9 @@ void Reset()
 
     SDIO::Reset();
     Wifi::Reset();
+
+    Rewind::Reset();
+    RunAhead::Reset();
 }
 
 void Start()
@@ -262,6 +413,11 @@ void Start()
     Running = true;
 }
 
+void SetFlashJournal(const char* filename)
+{
+    FlashJournal::SetFile(filename ? filename : "");
+}
+
 bool LoadFirmware(const char* filename)
 {
     Reset();
@@ -285,54 +441,103 @@ bool LoadBootAndFw(const char* boot, const char* fw)
 }
 
 
-u64 NextTarget()
+bool AfterFork()
 {
-    u64 minEvent = UINT64_MAX;
-
-    u32 mask = SchedListMask;
-    for (int i = 0; i < Event_MAX; i++)
+#ifdef JIT_ENABLED
+    if (!ARMJIT_Memory::UnshareMainRAM(MainRAM))
     {
-        if (!mask) break;
-        if (mask & 0x1)
-        {
-            if (SchedList[i].Timestamp < minEvent)
-                minEvent = SchedList[i].Timestamp;
-        }
+        Log(LogLevel::Error, "failed to unshare main RAM after fork\n");
+        return false;
+    }
+#endif
+    return true;
+}
+
 
-        mask >>= 1;
+int SetCPUMode(int mode)
+{
+    if (mode != CPUMode_Interpreter)
+    {
+        // falls back to the cached interpreter if the JIT isn't available
+        bool native = ARMJIT::SetNative(mode == CPUMode_JIT);
+        mode = native ? CPUMode_JIT : CPUMode_CachedInterpreter;
+    }
+    else if (CPUMode != CPUMode_Interpreter)
+    {
+        // the interpreter relies on the pipeline, which the block cache doesn't maintain
+        ARM9->FillPipeline();
     }
 
-    u64 max = SysTimestamp + kMaxIterationCycles;
+    CPUMode = mode;
+    return mode;
+}
 
-    if (minEvent < max + kIterationCycleMargin)
-        return minEvent;
 
-    return max;
+// the CPU runs until the next event, there is no point returning earlier.
+// if something gets scheduled sooner while it runs, Reschedule() pulls the
+// target back.
+u64 NextTarget(u64 frametarget)
+{
+    u64 target = frametarget;
+    if (!SchedHeap.empty() && SchedList[SchedHeap[0]].Timestamp < target)
+        target = SchedList[SchedHeap[0]].Timestamp;
+
+    return target;
 }
 
 void RunSystem(u64 timestamp)
 {
     SysTimestamp = timestamp;
 
-    u32 mask = SchedListMask;
-    for (int i = 0; i < Event_MAX; i++)
+    while (!SchedHeap.empty())
     {
-        if (!mask) break;
-        if (mask & 0x1)
-        {
-            if (SchedList[i].Timestamp <= SysTimestamp)
-            {
-                SchedListMask &= ~(1<<i);
-                SchedList[i].Func(SchedList[i].Param);
-            }
-        }
-
-        mask >>= 1;
+        u32 id = SchedHeap[0];
+        SchedEvent* evt = &SchedList[id];
+        if (evt->Timestamp > SysTimestamp)
+            break;
+
+        // the callback may register or schedule events, don't keep pointers around
+        void (*func)(u32) = evt->Func;
+        u32 param = evt->Param;
+        CancelEvent(id);
+        func(param);
     }
 }
 
 
+void SetRenderInterval(u32 interval)
+{
+    RenderInterval = interval ? interval : 1;
+    RenderCounter = 0;
+}
+
+bool IsFrameRendered()
+{
+    return FrameRendered;
+}
+
 u32 RunFrame()
+{
+    // run-ahead frames go along with the frame they belong to
+    RenderCounter++;
+    FrameRendered = (RenderCounter >= RenderInterval);
+    if (FrameRendered)
+        RenderCounter = 0;
+
+    Movie::FrameStart();
+
+    u32 ret = EmulateFrame();
+
+    FlashJournal::CommitFrame();
+    Movie::FrameEnd();
+    Rewind::CaptureFrame();
+
+    RunAhead::RunFrames();
+
+    return ret;
+}
+
+u32 EmulateFrame()
 {
     FrameStartTimestamp = SysTimestamp;
 
@@ -344,6 +549,7 @@ u32 RunFrame()
     u64 frametarget = SysTimestamp + framecnt;
 
     LagFrameFlag = true;
+    u32 numslices = 0;
     bool runFrame = Running;// && !(CPUStop & 0x40000000);
     if (runFrame)
     {
@@ -352,12 +558,14 @@ u32 RunFrame()
 
         while (Running)// && GPU::TotalScanlines==0)
         {
-            u64 target = NextTarget();
+            u64 target = NextTarget(frametarget);
             ARM9Target = target;
+            numslices++;
 
-            ARM9->Execute();
-
-            RunTimers();
+            if (CPUMode == CPUMode_Interpreter)
+                ARM9->Execute();
+            else
+                ARM9->ExecuteCached();
 
             target = ARM9Timestamp;
 
@@ -371,13 +579,15 @@ u32 RunFrame()
         // TODO: this should be done on VBlank
         SetIRQ(0x16);
         SetIRQ(0x1E);// HACK
-        Video::RenderFrame();
+        if (FrameRendered)
+            Video::RenderFrame();
         Audio::framehack();
     }
 
     // In the context of TASes, frame count is traditionally the primary measure of emulated time,
     // so it needs to be tracked even if NDS is powered off.
     NumFrames++;
+    NumFrameSlices = numslices;
     if (LagFrameFlag)
         NumLagFrames++;
 
@@ -392,53 +602,293 @@ void Reschedule(u64 target)
     }
 }
 
-void ScheduleEvent(u32 id, bool periodic, s32 delay, void (*func)(u32), u32 param)
+// events due at the same time run in ID order
+bool EventBefore(u32 a, u32 b)
 {
-    if (SchedListMask & (1<<id))
+    if (SchedList[a].Timestamp != SchedList[b].Timestamp)
+        return SchedList[a].Timestamp < SchedList[b].Timestamp;
+    return a < b;
+}
+
+void HeapSet(u32 pos, u32 id)
+{
+    SchedHeap[pos] = id;
+    SchedList[id].HeapIndex = pos;
+}
+
+void HeapSiftUp(u32 pos)
+{
+    u32 id = SchedHeap[pos];
+    while (pos > 0)
     {
-        Log(LogLevel::Debug, "!! EVENT %d ALREADY SCHEDULED\n", id);
-        return;
-    }
+        u32 parent = (pos - 1) >> 1;
+        if (!EventBefore(id, SchedHeap[parent]))
+            break;
 
-    SchedEvent* evt = &SchedList[id];
+        HeapSet(pos, SchedHeap[parent]);
+        pos = parent;
+    }
+    HeapSet(pos, id);
+}
 
-    if (periodic)
-        evt->Timestamp += delay;
-    else
+void HeapSiftDown(u32 pos)
+{
+    u32 id = SchedHeap[pos];
+    u32 num = SchedHeap.size();
+    for (;;)
     {
-        evt->Timestamp = ARM9Timestamp + delay;
+        u32 child = (pos << 1) + 1;
+        if (child >= num)
+            break;
+        if ((child + 1) < num && EventBefore(SchedHeap[child + 1], SchedHeap[child]))
+            child++;
+        if (!EventBefore(SchedHeap[child], id))
+            break;
+
+        HeapSet(pos, SchedHeap[child]);
+        pos = child;
     }
+    HeapSet(pos, id);
+}
+
+u32 RegisterEvent()
+{
+    SchedEvent evt;
+    evt.Func = nullptr;
+    evt.Timestamp = 0;
+    evt.Param = 0;
+    evt.HeapIndex = -1;
+
+    SchedList.push_back(evt);
+    return SchedList.size() - 1;
+}
+
+void ScheduleEvent(u32 id, u64 timestamp, void (*func)(u32), u32 param)
+{
+    SchedEvent* evt = &SchedList[id];
 
+    evt->Timestamp = timestamp;
     evt->Func = func;
     evt->Param = param;
 
-    SchedListMask |= (1<<id);
+    if (evt->HeapIndex < 0)
+    {
+        SchedHeap.push_back(id);
+        HeapSiftUp(SchedHeap.size() - 1);
+    }
+    else
+    {
+        // already pending, move it
+        HeapSiftUp(evt->HeapIndex);
+        HeapSiftDown(evt->HeapIndex);
+    }
 
     Reschedule(evt->Timestamp);
 }
 
-void ScheduleEvent(u32 id, u64 timestamp, void (*func)(u32), u32 param)
+void ScheduleEvent(u32 id, bool periodic, s32 delay, void (*func)(u32), u32 param)
 {
-    if (SchedListMask & (1<<id))
+    u64 timestamp;
+    if (periodic)
+        timestamp = SchedList[id].Timestamp + delay;
+    else
+        timestamp = ARM9Timestamp + delay;
+
+    ScheduleEvent(id, timestamp, func, param);
+}
+
+void CancelEvent(u32 id)
+{
+    SchedEvent* evt = &SchedList[id];
+    if (evt->HeapIndex < 0)
+        return;
+
+    u32 pos = evt->HeapIndex;
+    evt->HeapIndex = -1;
+
+    u32 last = SchedHeap.back();
+    SchedHeap.pop_back();
+    if (last == id)
+        return;
+
+    HeapSet(pos, last);
+    HeapSiftUp(pos);
+    HeapSiftDown(SchedList[last].HeapIndex);
+}
+
+void RegisterEventFunc(void (*func)(u32))
+{
+    for (auto f : EventFuncs)
     {
-        Log(LogLevel::Debug, "!! EVENT %d ALREADY SCHEDULED\n", id);
+        if (f == func) return;
+    }
+
+    EventFuncs.push_back(func);
+}
+
+void DoSavestate_Scheduler(Savestate* file)
+{
+    file->Section("SCHD");
+
+    u32 numevents = SchedList.size();
+    file->Var32(&numevents);
+    if (numevents != SchedList.size())
+    {
+        Log(LogLevel::Error, "savestate: wrong number of events, %d, expecting %d\n", numevents, (u32)SchedList.size());
+        file->Error = true;
         return;
     }
 
-    SchedEvent* evt = &SchedList[id];
+    for (u32 i = 0; i < numevents; i++)
+    {
+        SchedEvent* evt = &SchedList[i];
 
-    evt->Timestamp = timestamp;
-    evt->Func = func;
-    evt->Param = param;
+        // pending events are saved with the index of their function
+        u32 funcid = 0xFFFFFFFF;
+        if (file->Saving && evt->HeapIndex >= 0)
+        {
+            for (u32 j = 0; j < EventFuncs.size(); j++)
+            {
+                if (EventFuncs[j] == evt->Func)
+                {
+                    funcid = j;
+                    break;
+                }
+            }
 
-    SchedListMask |= (1<<id);
+            if (funcid == 0xFFFFFFFF)
+                Log(LogLevel::Error, "savestate: event %d has an unregistered function, it will be lost\n", i);
+        }
 
-    Reschedule(evt->Timestamp);
+        file->Var32(&funcid);
+        file->Var64(&evt->Timestamp);
+        file->Var32(&evt->Param);
+
+        if (!file->Saving)
+        {
+            evt->Func = (funcid < EventFuncs.size()) ? EventFuncs[funcid] : nullptr;
+            evt->HeapIndex = -1;
+        }
+    }
+
+    if (!file->Saving)
+    {
+        SchedHeap.clear();
+        for (u32 i = 0; i < numevents; i++)
+        {
+            if (!SchedList[i].Func) continue;
+
+            SchedHeap.push_back(i);
+            HeapSiftUp(SchedHeap.size() - 1);
+        }
+    }
 }
 
-void CancelEvent(u32 id)
+bool DoSavestate(Savestate* file)
+{
+    // incremental states only work if the dirty maps are relative to their base
+    u64& tracked = (file->DirtyBit == Dirty_Rewind) ? RewindBase : SavestateBase;
+    u64 base = file->Base ? file->BaseID : file->StateID;
+    file->DirtyTracked = tracked && (base == tracked);
+
+    file->Section("WUP.");
+
+    file->Var64(&ARM9Timestamp);
+    file->Var64(&ARM9Target);
+    file->Var64(&SysTimestamp);
+    file->Var64(&LastSysClockCycles);
+    file->Var64(&FrameStartTimestamp);
+
+    file->Var32(&NumFrames);
+    file->Var32(&NumLagFrames);
+
+    file->Var32(&SoftResetReg);
+
+    file->VarArray(IRQEnable, sizeof(IRQEnable));
+    file->Var64(&IRQMask);
+    file->Var32(&CurrentIRQ);
+    file->Var32(&IRQPriority);
+    file->Var32(&LastIRQPriority);
+
+    file->Var64(&TimerTimestamp);
+    file->VarArray(TimerPrescaler, sizeof(TimerPrescaler));
+    file->VarArray(TimerCounter, sizeof(TimerCounter));
+    file->Var32(&CountUpVal);
+    file->VarArray(TimerCnt, sizeof(TimerCnt));
+    file->VarArray(TimerTarget, sizeof(TimerTarget));
+    file->VarArray(TimerVal, sizeof(TimerVal));
+    file->VarArray(TimerSubCounter, sizeof(TimerSubCounter));
+
+    if (file->IsAtleastVersion(1, 1))
+        file->DirtyArray("MRAM", MainRAM, 0x400000, MainRAMDirty, file->DirtyBit, kDirtyPageShift);
+    else
+        file->VarArray(MainRAM, 0x400000);
+
+    DoSavestate_Scheduler(file);
+
+    ARM9->DoSavestate(file);
+
+    DMA::DoSavestate(file);
+
+    Flash::DoSavestate(file);
+    UIC::DoSavestate(file);
+    SPI::DoSavestate(file);
+
+    UART::DoSavestate(file);
+
+    AudioAmp::DoSavestate(file);
+    Camera::DoSavestate(file);
+    LCD::DoSavestate(file);
+    I2C::DoSavestate(file);
+
+    Video::DoSavestate(file);
+    Audio::DoSavestate(file);
+
+    SDIO::DoSavestate(file);
+    Wifi::DoSavestate(file);
+
+    // without memory, both are up to the caller
+    if (!file->WithMemory)
+        return !file->Error;
+
+    if (!file->Saving)
+    {
+        // whatever was compiled doesn't match memory anymore
+        ARMJIT::Reset();
+    }
+
+    // saving an incremental state doesn't change what we're tracking against.
+    // a failed load leaves memory in an unknown state for everyone
+    if (file->Error)
+    {
+        tracked = 0;
+        if (!file->Saving)
+            SavestateBase = RewindBase = 0;
+    }
+    else if (!file->Saving || !file->Base)
+        tracked = base;
+
+    return !file->Error;
+}
+
+bool SaveState(const char* filename)
+{
+    Savestate file;
+    if (!DoSavestate(&file))
+        return false;
+
+    return file.SaveToFile(filename);
+}
+
+bool LoadState(const char* filename)
 {
-    SchedListMask &= ~(1<<id);
+    Savestate* file = Savestate::LoadFromFile(filename);
+    if (!file)
+        return false;
+
+    bool ret = !file->Error && DoSavestate(file);
+    delete file;
+    return ret;
 }
 
 
@@ -456,8 +906,11 @@ void SoftReset()
     for (int i = 0; i < 0x28; i++)
         IRQEnable[i] |= (1<<6);
 
+    RunTimers();
     TimerCnt[0] = 0;
     TimerCnt[1] = 0;
+    ScheduleTimerEvent(0);
+    ScheduleTimerEvent(1);
 
     ARM9->SoftReset();
     printf("soft reset\n");
@@ -469,18 +922,23 @@ void SoftReset()
 }
 
 
+// while a movie is playing, input only comes from the movie
+
 void SetKeyMask(u32 mask)
 {
+    if (Movie::IsPlaying()) return;
     UIC::SetKeyMask(mask);
 }
 
 void SetTouchCoords(bool touching, int x, int y)
 {
+    if (Movie::IsPlaying()) return;
     UIC::SetTouchCoords(touching, x, y);
 }
 
 void SetVolume(u8 vol)
 {
+    if (Movie::IsPlaying()) return;
     UIC::SetVolume(vol);
 }
 
@@ -636,63 +1094,109 @@ u64 GetSysClockCycles(int num)
 
 
 
-void TickTimer(int timer)
+// returns how many ticks a prescaler produces over the given amount of cycles
+// a prescaler of N ticks once every N cycles, 0 ticks every cycle
+u64 RunPrescaler(int num, u64 cycles)
+{
+    u32 prescaler = TimerPrescaler[num];
+    if (!prescaler)
+        return cycles;
+
+    u64 counter = TimerCounter[num] + cycles;
+    if (counter <= prescaler)
+    {
+        TimerCounter[num] = (u32)counter;
+        return 0;
+    }
+
+    u64 ticks = (counter - 1) / prescaler;
+    TimerCounter[num] = (u32)(counter - (ticks * prescaler));
+    return ticks;
+}
+
+void AdvanceTimer(int timer, u64 ticks)
 {
     if (!(TimerCnt[timer] & (1<<1)))
         return;
 
     u32 prescaler = 2 << ((TimerCnt[timer] >> 4) & 0x7);
-    TimerSubCounter[timer]++;
-    if (TimerSubCounter[timer] >= prescaler)
+    u64 sub = TimerSubCounter[timer] + ticks;
+    u64 incs = sub / prescaler;
+    TimerSubCounter[timer] = (u32)(sub % prescaler);
+    if (!incs)
+        return;
+
+    // the counter goes from 0 to the target, then wraps and raises its IRQ
+    u64 val = TimerVal[timer];
+    u64 period = (u64)TimerTarget[timer] + 1;
+    if (val >= period)
     {
-        TimerSubCounter[timer] = 0;
+        // counter was set past the target
+        val = 0;
+        incs--;
+        SetIRQ(IRQ_Timer0 + timer);
+    }
 
-        TimerVal[timer]++;
-        if (TimerVal[timer] > TimerTarget[timer])
-        {
-            TimerVal[timer] = 0;
-            SetIRQ(IRQ_Timer0 + timer);
-        }
+    val += incs;
+    if (val >= period)
+    {
+        val %= period;
+        SetIRQ(IRQ_Timer0 + timer);
     }
+
+    TimerVal[timer] = (u32)val;
 }
 
 void RunTimers()
 {
-    u32 cycles = (u32)(ARM9Timestamp - TimerTimestamp);
-    TimerTimestamp = ARM9Timestamp;
+    TimersPolled = true;
 
-    if (TimerPrescaler[0] > 0)
+    // the CPU may be in the middle of a block
+    u64 now = ARM9Timestamp + ARM9->Cycles;
+    if (now <= TimerTimestamp)
+        return;
+
+    u64 cycles = now - TimerTimestamp;
+    TimerTimestamp = now;
+
+    u64 ticks = RunPrescaler(0, cycles);
+    if (ticks)
     {
-        TimerCounter[0] += cycles;
-        while (TimerCounter[0] > TimerPrescaler[0])
-        {
-            TimerCounter[0] -= TimerPrescaler[0];
-            TickTimer(0);
-            TickTimer(1);
-        }
+        AdvanceTimer(0, ticks);
+        AdvanceTimer(1, ticks);
     }
+
+    CountUpVal += (u32)RunPrescaler(1, cycles);
+}
+
+void TimerEvent(u32 timer)
+{
+    RunTimers();
+    ScheduleTimerEvent(timer);
+}
+
+void ScheduleTimerEvent(int timer)
+{
+    // timers need to be up to date when calling this
+    CancelEvent(Event_Timer0 + timer);
+    if (!(TimerCnt[timer] & (1<<1)))
+        return;
+
+    u32 prescaler = 2 << ((TimerCnt[timer] >> 4) & 0x7);
+    u64 incs;
+    if (TimerVal[timer] > TimerTarget[timer])
+        incs = 1;
     else
-    {
-        for (u32 i = 0; i < cycles; i++)
-        {
-            TickTimer(0);
-            TickTimer(1);
-        }
-    }
+        incs = (u64)TimerTarget[timer] - TimerVal[timer] + 1;
 
-    if (TimerPrescaler[1] > 0)
-    {
-        TimerCounter[1] += cycles;
-        while (TimerCounter[1] > TimerPrescaler[1])
-        {
-            TimerCounter[1] -= TimerPrescaler[1];
-            CountUpVal++;
-        }
-    }
+    u64 ticks = (incs * prescaler) - TimerSubCounter[timer];
+    u64 cycles;
+    if (TimerPrescaler[0])
+        cycles = (ticks * TimerPrescaler[0]) + 1 - TimerCounter[0];
     else
-    {
-        CountUpVal += cycles;
-    }
+        cycles = ticks;
+
+    ScheduleEvent(Event_Timer0 + timer, TimerTimestamp + cycles, TimerEvent, timer);
 }
 
 
@@ -705,142 +1209,223 @@ void debug(u32 param)
 
 
 
-u8 ARM9Read8(u32 addr)
+u8 UnmappedRead8(u32 addr)
 {
-    //if (addr==(0x00154258+0xD)) return 1;
-    //if (addr==(0x00140869)) return 0;
-    //printf("read8 %08X  @ %08X\n", addr, ARM9->R[15]);
-    if (addr < 0x40000000)
-    {
-        return *(u8*)&MainRAM[addr & 0x3FFFFF];
-    }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
+    printf("unknown read8 %08X @ %08X\n", addr, ARM9->R[15]);
+    return 0;
+}
+
+u16 UnmappedRead16(u32 addr)
+{
+    printf("unknown read16 %08X @ %08X\n", addr, ARM9->R[15]);
+    return 0;
+}
+
+u32 UnmappedRead32(u32 addr)
+{
+    printf("unknown read32 %08X @ %08X\n", addr, ARM9->R[15]);
+    return 0;
+}
+
+void UnmappedWrite8(u32 addr, u8 val)
+{
+    printf("unknown write8 %08X %02X @ %08X\n", addr, val, ARM9->R[15]);
+}
+
+void UnmappedWrite16(u32 addr, u16 val)
+{
+    printf("unknown write16 %08X %04X @ %08X\n", addr, val, ARM9->R[15]);
+}
+
+void UnmappedWrite32(u32 addr, u32 val)
+{
+    printf("unknown write32 %08X %08X @ %08X\n", addr, val, ARM9->R[15]);
+}
+
+// the SDIO registers only take up part of their page
+
+inline bool IsSDIOAddr(u32 addr)
+{
+    return addr >= 0xE0010000 && addr < 0xE0020000;
+}
+
+u8 SDIOPageRead8(u32 addr)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Read8(addr);
+    return UnmappedRead8(addr);
+}
+
+u16 SDIOPageRead16(u32 addr)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Read16(addr);
+    return UnmappedRead16(addr);
+}
+
+u32 SDIOPageRead32(u32 addr)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Read32(addr);
+    return UnmappedRead32(addr);
+}
+
+void SDIOPageWrite8(u32 addr, u8 val)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Write8(addr, val);
+    UnmappedWrite8(addr, val);
+}
+
+void SDIOPageWrite16(u32 addr, u16 val)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Write16(addr, val);
+    UnmappedWrite16(addr, val);
+}
+
+void SDIOPageWrite32(u32 addr, u32 val)
+{
+    if (IsSDIOAddr(addr)) return SDIO::Write32(addr, val);
+    UnmappedWrite32(addr, val);
+}
+
+const MemHandlers UnmappedHandlers =
+{
+    UnmappedRead8, UnmappedRead16, UnmappedRead32,
+    UnmappedWrite8, UnmappedWrite16, UnmappedWrite32
+};
+
+const MemHandlers SDIOHandlers =
+{
+    SDIOPageRead8, SDIOPageRead16, SDIOPageRead32,
+    SDIOPageWrite8, SDIOPageWrite16, SDIOPageWrite32
+};
+
+const MemHandlers IOHandlers =
+{
+    ARM9IORead8, ARM9IORead16, ARM9IORead32,
+    ARM9IOWrite8, ARM9IOWrite16, ARM9IOWrite32
+};
+
+void MarkRAMDirtyRange(u32 addr, u32 len)
+{
+    if (!len) return;
+    if (len >= 0x400000)
     {
-        return SDIO::Read8(addr);
+        memset(MainRAMDirty, Dirty_All, kNumRAMDirtyPages);
+        return;
     }
-    if (addr >= 0xF0000000)
+
+    u32 start = (addr & 0x3FFFFF) >> kDirtyPageShift;
+    u32 end = ((addr & 0x3FFFFF) + len - 1) >> kDirtyPageShift;
+    for (u32 i = start; i <= end; i++)
+        MainRAMDirty[i & (kNumRAMDirtyPages-1)] = Dirty_All;
+}
+
+void InitPageMap()
+{
+    for (u32 page = 0; page < kNumPages; page++)
     {
-        return ARM9IORead8(addr);
+        u32 addr = page << kPageShift;
+
+        ARM9PageMap[page] = NULL;
+        ARM9PageHandlers[page] = &UnmappedHandlers;
+
+        if (addr < 0x40000000)
+        {
+            // main RAM, mirrored
+            ARM9PageMap[page] = &MainRAM[addr & 0x3FFFFF];
+        }
+        else if (addr == (0xE0010000 & ~kPageMask))
+        {
+            ARM9PageHandlers[page] = &SDIOHandlers;
+        }
+        else if (addr >= 0xF0000000)
+        {
+            ARM9PageHandlers[page] = &IOHandlers;
+        }
     }
+}
 
-    printf("unknown read8 %08X @ %08X\n", addr, ARM9->R[15]);
-    return 0;
+
+u8 ARM9Read8(u32 addr)
+{
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
+        return *(u8*)&page[addr & kPageMask];
+
+    return ARM9PageHandlers[addr >> kPageShift]->Read8(addr);
 }
 
 u16 ARM9Read16(u32 addr)
 {
     addr &= ~0x1;
 
-    //printf("read16 %08X  @ %08X\n", addr, ARM9->R[15]);
-    if (addr < 0x40000000)
-    {
-        return *(u16*)&MainRAM[addr & 0x3FFFFF];
-    }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
-    {
-        return SDIO::Read16(addr);
-    }
-    if (addr >= 0xF0000000)
-    {
-        return ARM9IORead16(addr);
-    }
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
+        return *(u16*)&page[addr & kPageMask];
 
-    printf("unknown read16 %08X @ %08X\n", addr, ARM9->R[15]);
-    return 0;
+    return ARM9PageHandlers[addr >> kPageShift]->Read16(addr);
 }
 
 u32 ARM9Read32(u32 addr)
 {
     addr &= ~0x3;
 
-    //printf("read32 %08X  @ %08X\n", addr, ARM9->R[15]);
-    if (addr < 0x40000000)
-    {
-        return *(u32*)&MainRAM[addr & 0x3FFFFF];
-    }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
-    {
-        return SDIO::Read32(addr);
-    }
-    if (addr >= 0xF0000000)
-    {
-        return ARM9IORead32(addr);
-    }
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
+        return *(u32*)&page[addr & kPageMask];
 
-    printf("unknown read32 %08X @ %08X\n", addr, ARM9->R[15]);
-    return 0;
+    return ARM9PageHandlers[addr >> kPageShift]->Read32(addr);
 }
 
 void ARM9Write8(u32 addr, u8 val)
 {
-    //printf("write8 %08X %02X  @ %08X\n", addr, val, ARM9->R[15]);
-    if (addr < 0x40000000)
-    {
-        *(u8*)&MainRAM[addr & 0x3FFFFF] = val;
-        return;
-    }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
     {
-        SDIO::Write8(addr, val);
+        *(u8*)&page[addr & kPageMask] = val;
+        MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
         return;
     }
-    if (addr >= 0xF0000000)
-    {
-        return ARM9IOWrite8(addr, val);
-    }
 
-    printf("unknown write8 %08X %02X @ %08X\n", addr, val, ARM9->R[15]);
+    ARM9PageHandlers[addr >> kPageShift]->Write8(addr, val);
 }
 
 void ARM9Write16(u32 addr, u16 val)
 {
     addr &= ~0x1;
 
-    //printf("write16 %08X %04X  @ %08X\n", addr, val, ARM9->R[15]);
-    if (addr < 0x40000000)
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
     {
-        *(u16*)&MainRAM[addr & 0x3FFFFF] = val;
+        *(u16*)&page[addr & kPageMask] = val;
+        MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
         return;
     }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
-    {
-        SDIO::Write16(addr, val);
-        return;
-    }
-    if (addr >= 0xF0000000)
-    {
-        return ARM9IOWrite16(addr, val);
-    }
 
-    printf("unknown write16 %08X %04X @ %08X\n", addr, val, ARM9->R[15]);
+    ARM9PageHandlers[addr >> kPageShift]->Write16(addr, val);
 }
 
 void ARM9Write32(u32 addr, u32 val)
 {
     addr &= ~0x3;
 
-    //printf("write32 %08X %08X  @ %08X\n", addr, val, ARM9->R[15]);
-    if (addr < 0x40000000)
-    {
-        *(u32*)&MainRAM[addr & 0x3FFFFF] = val;
-        return;
-    }
-    if (addr >= 0xE0010000 && addr < 0xE0020000)
+    u8* page = ARM9PageMap[addr >> kPageShift];
+    if (page)
     {
-        SDIO::Write32(addr, val);
+        *(u32*)&page[addr & kPageMask] = val;
+        MarkRAMDirty(addr);
+        ARMJIT::CheckAndInvalidate(addr);
         return;
     }
-    if (addr >= 0xF0000000)
-    {
-        return ARM9IOWrite32(addr, val);
-    }
 
-    printf("unknown write32 %08X %08X @ %08X\n", addr, val, ARM9->R[15]);
+    ARM9PageHandlers[addr >> kPageShift]->Write32(addr, val);
 }
 
 bool ARM9GetMemRegion(u32 addr, bool write, MemRegion* region)
 {
-    if (addr < 0x40000000)
+    // all RAM-backed pages are main RAM mirrors, so the whole of it can be
+    // returned, which keeps the region valid across page boundaries
+    if (ARM9PageMap[addr >> kPageShift])
     {
         region->Mem = MainRAM;
         region->Mask = 0x3FFFFF;
@@ -898,12 +1483,12 @@ u32 ARM9IORead32(u32 addr)
 
     case 0xF0000400: return TimerPrescaler[0];
     case 0xF0000404: return TimerPrescaler[1];
-    case 0xF0000408: return CountUpVal;
+    case 0xF0000408: RunTimers(); return CountUpVal;
     case 0xF0000410: return TimerCnt[0];
-    case 0xF0000414: return TimerVal[0];
+    case 0xF0000414: RunTimers(); return TimerVal[0];
     case 0xF0000418: return TimerTarget[0];
     case 0xF0000420: return TimerCnt[1];
-    case 0xF0000424: return TimerVal[1];
+    case 0xF0000424: RunTimers(); return TimerVal[1];
     case 0xF0000428: return TimerTarget[1];
 
     case 0xF00013F0:
@@ -941,7 +1526,7 @@ void ARM9IOWrite32(u32 addr, u32 val)
     {
         addr = (addr - 0xF0001208) >> 2;
         IRQEnable[addr] = val & 0xFF;
-        if (addr!=4) printf("IRQEnable[%02X] = %02X\n", addr, val&0xFF);
+        if (addr!=4) Log(LogChannel::IRQ, LogLevel::Debug, "IRQEnable[%02X] = %02X\n", addr, val&0xFF);
         return;
     }
 
@@ -971,44 +1556,61 @@ void ARM9IOWrite32(u32 addr, u32 val)
         return;
 
     case 0xF0000400:
+        RunTimers();
         TimerPrescaler[0] = val & 0xFF;
         TimerCounter[0] = 0; // checkme
+        ScheduleTimerEvent(0);
+        ScheduleTimerEvent(1);
         return;
     case 0xF0000404:
+        RunTimers();
         TimerPrescaler[1] = val & 0xFF;
         TimerCounter[1] = 0; // checkme
         return;
 
     case 0xF0000408:
+        RunTimers();
         CountUpVal = val;
         return;
 
     case 0xF0000410:
+        RunTimers();
         TimerCnt[0] = val;
         if (!(val & (1<<1)))
             TimerVal[0] = 0;
         else
             TimerSubCounter[0] = 0;
+        ScheduleTimerEvent(0);
         return;
     case 0xF0000414:
+        RunTimers();
         TimerVal[0] = val;
+        ScheduleTimerEvent(0);
         return;
     case 0xF0000418:
+        RunTimers();
         TimerTarget[0] = val;
+        ScheduleTimerEvent(0);
         return;
 
     case 0xF0000420:
+        RunTimers();
         TimerCnt[1] = val;
         if (!(val & (1<<1)))
             TimerVal[1] = 0;
         else
             TimerSubCounter[1] = 0;
+        ScheduleTimerEvent(1);
         return;
     case 0xF0000424:
+        RunTimers();
         TimerVal[1] = val;
+        ScheduleTimerEvent(1);
         return;
     case 0xF0000428:
+        RunTimers();
         TimerTarget[1] = val;
+        ScheduleTimerEvent(1);
         return;
 
     case 0xF00013F8:
@@ -23,6 +23,8 @@
 
 #include "types.h"
 
+class Savestate;
+
 namespace WUP
 {
 
@@ -34,6 +36,9 @@ enum
     Event_UART,
     Event_WifiResponse,
 
+    Event_Timer0,
+    Event_Timer1,
+
     Event_MAX
 };
 
@@ -42,6 +47,7 @@ struct SchedEvent
     void (*Func)(u32 param);
     u64 Timestamp;
     u32 Param;
+    s32 HeapIndex; // position in the event queue, -1 if not scheduled
 };
 
 enum
@@ -76,39 +82,133 @@ enum
     Mem9_MainRAM    = 0x00000001,
 };
 
+enum
+{
+    CPUMode_Interpreter = 0,
+    CPUMode_CachedInterpreter,
+    CPUMode_JIT,
+};
+
 struct MemRegion
 {
     u8* Mem;
     u32 Mask;
 };
 
+// the ARM9 address space is split in 1MB pages. RAM-backed pages point
+// straight to host memory, the rest go through a set of handlers
+const u32 kPageShift = 20;
+const u32 kPageMask = (1 << kPageShift) - 1;
+const u32 kNumPages = 1 << (32 - kPageShift);
+
+struct MemHandlers
+{
+    u8 (*Read8)(u32 addr);
+    u16 (*Read16)(u32 addr);
+    u32 (*Read32)(u32 addr);
+    void (*Write8)(u32 addr, u8 val);
+    void (*Write16)(u32 addr, u16 val);
+    void (*Write32)(u32 addr, u32 val);
+};
+
+
+// bus timings are set for whole 1MB pages. the few different settings in
+// use are kept as descriptors, and each page refers to one of them
+struct RegionTimings
+{
+    u8 CPU[4]; // N16, S16, N32, S32
+    u8 DMA[4];
+    u32 Region;
+};
+
+const u32 kMaxTimingRegions = 32;
+extern thread_local RegionTimings ARM9Timings[kMaxTimingRegions];
+extern thread_local u8 ARM9TimingMap[kNumPages];
+
+inline const RegionTimings& GetARM9Timings(u32 addr)
+{
+    return ARM9Timings[ARM9TimingMap[addr >> kPageShift]];
+}
 
-extern u8 ARM9MemTimings[0x40000][8];
-extern u32 ARM9Regions[0x40000];
+extern thread_local u32 NumFrames;
+extern thread_local u32 NumLagFrames;
+extern thread_local bool LagFrameFlag;
+extern thread_local u32 NumFrameSlices;
 
-extern u32 NumFrames;
-extern u32 NumLagFrames;
-extern bool LagFrameFlag;
+extern thread_local u64 ARM9Timestamp, ARM9Target;
 
-extern u64 ARM9Timestamp, ARM9Target;
+extern thread_local u8* MainRAM;
 
-extern u8 MainRAM[0x400000];
+// main RAM and the flash are tracked in 4KB pages. writing to a page sets
+// all the bits in its dirty map entry, and each user clears its own bit
+const u32 kDirtyPageShift = 12;
+const u32 kNumRAMDirtyPages = 0x400000 >> kDirtyPageShift;
+extern thread_local u8 MainRAMDirty[kNumRAMDirtyPages];
+
+enum
+{
+    Dirty_Savestate = (1<<0), // incremental savestates, see DoSavestate()
+    Dirty_RunAhead = (1<<1),
+    Dirty_Journal = (1<<2), // flash only, see FlashJournal
+    Dirty_Rewind = (1<<3),
+
+    Dirty_All = 0xFF
+};
+
+inline void MarkRAMDirty(u32 addr)
+{
+    MainRAMDirty[(addr & 0x3FFFFF) >> kDirtyPageShift] = Dirty_All;
+}
+void MarkRAMDirtyRange(u32 addr, u32 len);
+
+extern thread_local u8* ARM9PageMap[kNumPages];
+extern thread_local const MemHandlers* ARM9PageHandlers[kNumPages];
 extern u32 MainRAMMask;
 
 
+// the emulator state is kept per thread: each thread that calls Init() gets
+// its own emulator instance, which lives until it calls DeInit(). several
+// instances can run at once on different threads. firmware images loaded by
+// several instances are shared between them (see Flash::LoadFirmware()).
+// most state lives in thread-local storage. only the big buffers (main RAM,
+// the flash, the JIT block lists and fast cache, the wifi RAM) are allocated
+// by each subsystem's Init(), to keep the per-thread storage small.
 bool Init();
 void DeInit();
 void Reset();
 void Start();
 
+// to be called in the child process after fork(). the child can then keep
+// running the emulator without affecting the parent, everything else is
+// copied on write
+bool AfterFork();
+
+// returns the mode actually in use
+int SetCPUMode(int mode);
+
+// addresses are in 4KB units, and get rounded out to whole pages
 void SetARM9RegionTimings(u32 addrstart, u32 addrend, u32 region, int buswidth, int nonseq, int seq);
 
+// keeps the flash contents in a journal file between runs, see FlashJournal.
+// applies to the firmware loaded next, nullptr disables it
+void SetFlashJournal(const char* filename);
+
 bool LoadFirmware(const char* filename);
 bool LoadBootAndFw(const char* boot, const char* fw);
 
+// runs a frame, along with movies, rewind and run-ahead
 u32 RunFrame();
+// only runs the emulated hardware
+u32 EmulateFrame();
 u32* GetFramebuffer();
 
+// draws only one frame out of every 'interval' (1 = all of them), for fast
+// forwarding. the emulated hardware still runs every frame as usual.
+// the framebuffer keeps the last frame drawn
+void SetRenderInterval(u32 interval);
+// whether the last frame run was drawn
+bool IsFrameRendered();
+
 void SetKeyMask(u32 mask);
 void SetTouchCoords(bool touching, int x, int y);
 void SetVolume(u8 vol);
@@ -123,10 +223,29 @@ void SetLidClosed(bool closed);
 void CamInputFrame(int cam, u32* data, int width, int height, bool rgb);
 void MicInputFrame(s16* data, int samples);*/
 
+// allocates a new event ID, on top of the fixed ones above
+u32 RegisterEvent();
+
+// scheduling an event which is already pending moves it to the new time
 void ScheduleEvent(u32 id, bool periodic, s32 delay, void (*func)(u32), u32 param);
 void ScheduleEvent(u32 id, u64 timestamp, void (*func)(u32), u32 param);
 void CancelEvent(u32 id);
 
+// functions which may be pending in the scheduler have to be registered,
+// so that savestates can refer to them
+void RegisterEventFunc(void (*func)(u32));
+
+// if loading fails, the emulator is left in an undefined state and should be reset
+//
+// states can be incremental: a state created against a base only stores the
+// pages of main RAM and the flash written since the base was saved or loaded,
+// and restoring only copies back the pages that differ. for this to work, the
+// base has to be the last full state saved or loaded, otherwise whole memory
+// is saved or restored as usual.
+bool DoSavestate(Savestate* file);
+bool SaveState(const char* filename);
+bool LoadState(const char* filename);
+
 void debug(u32 p);
 
 void Halt();
@@ -138,6 +257,10 @@ bool HaltInterrupted();
 u32 GetPC();
 u64 GetSysClockCycles(int num);
 
+// set whenever the timers are brought up to date, so that the CPU can tell
+// if an idle loop is waiting on them
+extern thread_local bool TimersPolled;
+
 void RunTimers();
 
 u8 ARM9Read8(u32 addr);
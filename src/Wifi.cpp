@@ -27,7 +27,9 @@
 #include "Platform.h"
 
 using Platform::Log;
+using Platform::LogHex;
 using Platform::LogLevel;
+using Platform::LogChannel;
 
 namespace Wifi
 {
@@ -52,22 +54,22 @@ const u8 EnumROM[] =
     0x35, 0x40, 0x01, 0x1E, 0x00, 0xC0, 0xFE, 0x01, 0x85, 0xA0, 0x10, 0x18, 0x0F, 0x00, 0x00, 0x00, // 0xF0-0xFF
 };
 
-u8 FuncEnable;
-u8 FuncReady;
+thread_local u8 FuncEnable;
+thread_local u8 FuncReady;
 
-u8 TransferFunc;
-u32 TransferAddr;
-int TransferIncr;
-u32 TransferLen;
+thread_local u8 TransferFunc;
+thread_local u32 TransferAddr;
+thread_local int TransferIncr;
+thread_local u32 TransferLen;
 
-u16 F1BlockSize;
-u16 F2BlockSize;
+thread_local u16 F1BlockSize;
+thread_local u16 F2BlockSize;
 
-u8 ClockCnt;
+thread_local u8 ClockCnt;
 
-u32 F1BaseAddr;
+thread_local u32 F1BaseAddr;
 //u32 F1LastAddr;
-u32 F1Temp;
+thread_local u32 F1Temp;
 
 struct sCore
 {
@@ -82,35 +84,36 @@ struct sCore
 // 3 = ARM Cortex-M3
 // 4 = RAM
 // 5 = USB2.0 device
-sCore Cores[6];
+thread_local sCore Cores[6];
 
-u8 RAM[0x48000];
+const u32 kRAMSize = 0x48000;
+thread_local u8* RAM;
 
-u32 IRQStatus;
-u32 IRQEnable;
+thread_local u32 IRQStatus;
+thread_local u32 IRQEnable;
 
-FIFO<u8, 0x8000> RXMailbox; // incoming F2 data
-FIFO<u8, 0x8000> TXMailbox; // outgoing F2 data
+thread_local FIFO<u8, 0x8000> RXMailbox; // incoming F2 data
+thread_local FIFO<u8, 0x8000> TXMailbox; // outgoing F2 data
 
-u8 Scratch[0x8000];
+thread_local u8 Scratch[0x8000];
 
 // ioctl vars
 const u8 MACAddr[6] = {0x40, 0xF4, 0x01, 0x23, 0x45, 0x67};
-u32 RoamOff;
-u32 SgiTx;
-u32 SgiRx;
-u32 AmpduTxfailEvent;
-u32 AcRemapMode;
-u8 EventMsgs[12];
-u32 Ampdu;
-u32 Country;
-u32 Lifetime;
-
-u32 RadioDisable;
-u32 Srl, Lrl;
-
-u32 BcnTimeout;
-u32 SupWpa;
+thread_local u32 RoamOff;
+thread_local u32 SgiTx;
+thread_local u32 SgiRx;
+thread_local u32 AmpduTxfailEvent;
+thread_local u32 AcRemapMode;
+thread_local u8 EventMsgs[12];
+thread_local u32 Ampdu;
+thread_local u32 Country;
+thread_local u32 Lifetime;
+
+thread_local u32 RadioDisable;
+thread_local u32 Srl, Lrl;
+
+thread_local u32 BcnTimeout;
+thread_local u32 SupWpa;
 
 struct sVarEntry
 {
@@ -126,7 +129,7 @@ sVarEntry _varEntry(u8* data, u32 len)
     return ret;
 }
 
-std::unordered_map<std::string, sVarEntry> VarMap;
+thread_local std::unordered_map<std::string, sVarEntry> VarMap;
 
 // WIFI RESPONSES
 //
@@ -140,8 +143,14 @@ std::unordered_map<std::string, sVarEntry> VarMap;
          */
 
 
+void MB_SignalCB(u32 param);
+
 bool Init()
 {
+    WUP::RegisterEventFunc(MB_SignalCB);
+
+    RAM = new u8[kRAMSize];
+
     VarMap["cur_etheraddr"] = _varEntry((u8*)MACAddr, 6);
     VarMap["roam_off"] = _varEntry((u8*)&RoamOff, 4);
     VarMap["sgi_tx"] = _varEntry((u8*)&SgiTx, 4);
@@ -161,6 +170,8 @@ bool Init()
 
 void DeInit()
 {
+    delete[] RAM;
+    RAM = NULL;
 }
 
 void Reset()
@@ -195,7 +206,7 @@ void Reset()
     Cores[2].IOCtrl = 0x1;
     Cores[2].ResetCtrl = 0;
 
-    memset(RAM, 0, 0x48000);
+    memset(RAM, 0, kRAMSize);
 
     IRQStatus = 0;
     IRQEnable = 0;
@@ -226,6 +237,60 @@ void Reset()
     SupWpa = 0;
 }
 
+void DoSavestate(Savestate* file)
+{
+    file->Section("WIFI");
+
+    file->Var8(&FuncEnable);
+    file->Var8(&FuncReady);
+
+    file->Var8(&TransferFunc);
+    file->Var32(&TransferAddr);
+    file->Var32((u32*)&TransferIncr);
+    file->Var32(&TransferLen);
+
+    file->Var16(&F1BlockSize);
+    file->Var16(&F2BlockSize);
+
+    file->Var8(&ClockCnt);
+
+    file->Var32(&F1BaseAddr);
+    file->Var32(&F1Temp);
+
+    for (int i = 0; i < 6; i++)
+    {
+        file->Var32(&Cores[i].IOCtrl);
+        file->Var32(&Cores[i].ResetCtrl);
+    }
+
+    file->VarArray(RAM, kRAMSize);
+
+    file->Var32(&IRQStatus);
+    file->Var32(&IRQEnable);
+
+    RXMailbox.DoSavestate(file);
+    TXMailbox.DoSavestate(file);
+
+    file->VarArray(Scratch, sizeof(Scratch));
+
+    file->Var32(&RoamOff);
+    file->Var32(&SgiTx);
+    file->Var32(&SgiRx);
+    file->Var32(&AmpduTxfailEvent);
+    file->Var32(&AcRemapMode);
+    file->VarArray(EventMsgs, sizeof(EventMsgs));
+    file->Var32(&Ampdu);
+    file->Var32(&Country);
+    file->Var32(&Lifetime);
+
+    file->Var32(&RadioDisable);
+    file->Var32(&Srl);
+    file->Var32(&Lrl);
+
+    file->Var32(&BcnTimeout);
+    file->Var32(&SupWpa);
+}
+
 
 void SetIRQ(int irq)
 {
@@ -335,7 +400,7 @@ void MakeIoctlRespHeader(u32 ioctl, u32 datalen, u8 seqno, u32 reqid, u32 status
 void IoctlGetVar(u8* data, u32 datalen, u8 seqno, u32 reqid)
 {
     char* var = (char*)data;
-    printf("WIFI: GetVar %s\n", var);
+    Log(LogChannel::Wifi, LogLevel::Debug, "WIFI: GetVar %s\n", var);
     if (VarMap.count(var))
     {
         auto& entry = VarMap[var];
@@ -350,7 +415,7 @@ void IoctlGetVar(u8* data, u32 datalen, u8 seqno, u32 reqid)
         return;
     }
 
-    printf("IoctlGetVar: unknown var name %s\n", var);
+    Log(LogChannel::Wifi, LogLevel::Error, "IoctlGetVar: unknown var name %s\n", var);
     exit(-1);
 }
 
@@ -358,10 +423,8 @@ void IoctlSetVar(u8* data, u32 datalen, u8 seqno, u32 reqid)
 {
     char* var = (char*)data;
     u8* val = data + strlen(var) + 1;
-    printf("WIFI: SetVar %s\n", var);
-    for (u32 i = 0; i < datalen-strlen(var)-1; i++)
-        printf("%02X:", val[i]);
-    printf("\n");
+    Log(LogChannel::Wifi, LogLevel::Debug, "WIFI: SetVar %s\n", var);
+    LogHex(LogChannel::Wifi, LogLevel::Debug, val, datalen-strlen(var)-1);
 
     if (VarMap.count(var))
     {
@@ -382,16 +445,14 @@ void IoctlSetVar(u8* data, u32 datalen, u8 seqno, u32 reqid)
         return;
     }
 
-    printf("IoctlSetVar: unknown var name %s\n", var);
+    Log(LogChannel::Wifi, LogLevel::Error, "IoctlSetVar: unknown var name %s\n", var);
     exit(-1);
 }
 
 void HandleIoctl(u8 seqno, u16 opc, u8* data, u32 datalen, u32 reqid)
 {
-    printf("WIFI: IOCTL %d  len=%d\n", opc, datalen);
-    for (u32 i = 0; i < datalen; i++)
-        printf("%02X:", data[i]);
-    printf("\n");
+    Log(LogChannel::Wifi, LogLevel::Debug, "WIFI: IOCTL %d  len=%d\n", opc, datalen);
+    LogHex(LogChannel::Wifi, LogLevel::Debug, data, datalen);
     switch (opc)
     {
     case 2: // up
@@ -429,7 +490,7 @@ void HandleIoctl(u8 seqno, u16 opc, u8* data, u32 datalen, u32 reqid)
             u32 ssidlen = *(u32*)&data[0];
             memset(ssid, 0, 33);
             memcpy(ssid, &data[4], ssidlen);
-            printf(" - JOIN NETWORK %s\n", ssid);
+            Log(LogChannel::Wifi, LogLevel::Info, " - JOIN NETWORK %s\n", ssid);
         }
         MakeIoctlRespHeader(opc, 4, seqno, reqid);
         MB_Write32(1);
@@ -522,13 +583,8 @@ void HandleIoctl(u8 seqno, u16 opc, u8* data, u32 datalen, u32 reqid)
         return;
     }
 
-    printf("HandleIoctl: unknown ioctl %d, len=%d\n", opc, datalen);
-    for (int i = 0; i < datalen; i++)
-    {
-        if (!(i&0xF)) printf("%08X:  ", i);
-        printf("%02X ", data[i]);
-        if ((i&0xF)==0xF) printf("\n");
-    }
+    Log(LogChannel::Wifi, LogLevel::Error, "HandleIoctl: unknown ioctl %d, len=%d\n", opc, datalen);
+    LogHex(LogChannel::Wifi, LogLevel::Error, data, datalen);
     exit(-1);
 }
 
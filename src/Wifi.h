@@ -20,6 +20,7 @@
 #define WIFI_H
 
 #include "types.h"
+#include "Savestate.h"
 
 namespace Wifi
 {
@@ -33,6 +34,7 @@ enum
 bool Init();
 void DeInit();
 void Reset();
+void DoSavestate(Savestate* file);
 
 void SendCommand(u8 cmd, u32 arg);
 void ReadBlock(u8* data, u32 len);
@@ -0,0 +1,183 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+// headless benchmark runner
+//
+// boots the given firmware, runs a fixed amount of frames as fast as possible
+// and reports the results as a single line of JSON, to stdout or to a file.
+// the emulator itself is rather chatty, so using -o is recommended.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "WUP.h"
+#include "Rewind.h"
+#include "Movie.h"
+#include "RunAhead.h"
+
+typedef std::chrono::steady_clock Clock;
+
+void Usage()
+{
+    printf("usage: pomelopad_bench [options] <firmware.bin>\n");
+    printf("       pomelopad_bench [options] <bootloader.bin> <melonpad.fw>\n");
+    printf("options:\n");
+    printf("  -n, --frames <num>    number of frames to run (default 600)\n");
+    printf("  -o, --output <file>   write the results to a file instead of stdout\n");
+    printf("  --no-jit              use the cached interpreter\n");
+    printf("  --interpreter         use the plain interpreter\n");
+    printf("  --rewind <MB>         capture rewind history with the given budget\n");
+    printf("  --movie <file>        replay an input movie, for reproducible runs\n");
+    printf("  --run-ahead <num>     run the given number of frames ahead\n");
+}
+
+const char* CPUModeName(int mode)
+{
+    switch (mode)
+    {
+    case WUP::CPUMode_Interpreter: return "interpreter";
+    case WUP::CPUMode_CachedInterpreter: return "cached_interpreter";
+    case WUP::CPUMode_JIT: return "jit";
+    }
+    return "unknown";
+}
+
+int main(int argc, char** argv)
+{
+    int cpumode = WUP::CPUMode_JIT;
+    u32 numframes = 600;
+    const char* outfile = nullptr;
+    const char* files[2] = {nullptr, nullptr};
+    int numfiles = 0;
+    u32 rewindbudget = 0;
+    const char* moviefile = nullptr;
+    u32 runahead = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--frames")) && (i+1) < argc)
+            numframes = strtoul(argv[++i], nullptr, 0);
+        else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) && (i+1) < argc)
+            outfile = argv[++i];
+        else if (!strcmp(argv[i], "--no-jit"))
+            cpumode = WUP::CPUMode_CachedInterpreter;
+        else if (!strcmp(argv[i], "--interpreter"))
+            cpumode = WUP::CPUMode_Interpreter;
+        else if (!strcmp(argv[i], "--rewind") && (i+1) < argc)
+            rewindbudget = strtoul(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--movie") && (i+1) < argc)
+            moviefile = argv[++i];
+        else if (!strcmp(argv[i], "--run-ahead") && (i+1) < argc)
+            runahead = strtoul(argv[++i], nullptr, 0);
+        else if (argv[i][0] != '-' && numfiles < 2)
+            files[numfiles++] = argv[i];
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    if (!numfiles || !numframes)
+    {
+        Usage();
+        return 1;
+    }
+
+    if (!WUP::Init())
+    {
+        printf("failed to initialize the emulator\n");
+        return 1;
+    }
+
+    cpumode = WUP::SetCPUMode(cpumode);
+
+    bool loaded;
+    if (numfiles == 2)
+        loaded = WUP::LoadBootAndFw(files[0], files[1]);
+    else
+        loaded = WUP::LoadFirmware(files[0]);
+    if (!loaded)
+    {
+        printf("failed to load firmware\n");
+        WUP::DeInit();
+        return 1;
+    }
+
+    if (moviefile && !Movie::StartPlayback(moviefile))
+    {
+        printf("failed to load movie %s\n", moviefile);
+        WUP::DeInit();
+        return 1;
+    }
+
+    if (rewindbudget)
+        Rewind::SetEnabled(true, (u64)rewindbudget << 20);
+    RunAhead::SetFrames(runahead);
+
+    WUP::Start();
+
+    u64 startcycles = WUP::ARM9Timestamp;
+    u64 numslices = 0;
+    double maxframetime = 0;
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point last = start;
+    for (u32 i = 0; i < numframes; i++)
+    {
+        WUP::RunFrame();
+        numslices += WUP::NumFrameSlices;
+
+        Clock::time_point now = Clock::now();
+        double frametime = std::chrono::duration<double>(now - last).count();
+        if (frametime > maxframetime) maxframetime = frametime;
+        last = now;
+    }
+
+    double hosttime = std::chrono::duration<double>(last - start).count();
+    u64 cycles = WUP::ARM9Timestamp - startcycles;
+
+    FILE* f = stdout;
+    if (outfile)
+    {
+        f = fopen(outfile, "w");
+        if (!f)
+        {
+            printf("failed to open %s\n", outfile);
+            WUP::DeInit();
+            return 1;
+        }
+    }
+
+    fprintf(f, "{\"cpu_mode\": \"%s\", \"frames\": %u, \"host_seconds\": %.6f, "
+               "\"emulated_cycles\": %llu, \"cycles_per_second\": %.0f, \"frames_per_second\": %.3f, "
+               "\"ms_per_frame\": %.4f, \"max_ms_per_frame\": %.4f, \"slices_per_frame\": %.2f, "
+               "\"rewind_frames\": %u, \"rewind_memory_mb\": %.2f}\n",
+            CPUModeName(cpumode), numframes, hosttime,
+            (unsigned long long)cycles, cycles / hosttime, numframes / hosttime,
+            (hosttime * 1000.0) / numframes, maxframetime * 1000.0, (double)numslices / numframes,
+            Rewind::NumFrames(), Rewind::MemoryUsed() / (1024.0*1024.0));
+
+    if (outfile)
+        fclose(f);
+
+    WUP::DeInit();
+    return 0;
+}
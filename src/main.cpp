@@ -18,9 +18,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #include "WUP.h"
+#include "Movie.h"
+#include "RunAhead.h"
+#include "Platform.h"
 
 using namespace std;
 
@@ -49,18 +57,185 @@ int keymap[] = {
     -1
 };
 
-int main()
+const int kScreenWidth = 854;
+const int kScreenHeight = 480;
+
+// the emulator runs on its own thread, at its own pace
+const double kFrameTime = 1.0 / 60.0;
+
+// completed frames are handed over through three buffers: one the emulator
+// thread draws into, one the frontend is displaying, and one holding the
+// latest complete frame. handing over a frame is just swapping buffer indices,
+// so neither side ever waits for the other.
+const int kNewFrame = 0x4;
+
+u32* FrameBuffers[3];
+std::atomic<int> LatestFrame; // buffer index, | kNewFrame if it wasn't picked up yet
+
+// input from the frontend, picked up before each frame
+std::atomic<u32> InputKeys;
+std::atomic<u32> InputTouch; // bit 31 = touching, 30-16 = Y, 15-0 = X
+std::atomic<int> InputVolume; // -1 if unchanged
+
+// turbo: run uncapped, and only draw one frame out of TurboRenderInterval
+std::atomic<bool> Turbo;
+const int kDefaultTurboInterval = 8;
+const int kTurboKey = SDL_SCANCODE_GRAVE; // not in keymap
+
+std::atomic<bool> EmuQuit;
+std::atomic<int> EmuStatus; // 0 = starting, 1 = running, -1 = failed
+
+struct EmuOptions
 {
-    SDL_Init(SDL_INIT_VIDEO);
-    printf("pomelopad 0.1 or something\n");
+    int CPUMode;
+    int RunAhead;
+    const char* RecordFile;
+    const char* PlayFile;
+    const char* FlashJournal;
+    int TurboInterval;
+};
 
+// the emulator state is per thread, so everything emulator related is done
+// from here
+void EmuThread(EmuOptions opt)
+{
     WUP::Init();
+    WUP::SetCPUMode(opt.CPUMode);
+    RunAhead::SetFrames(opt.RunAhead);
+
+    // movies have to start from the same flash contents every time
+    if (opt.FlashJournal && !opt.PlayFile && !opt.RecordFile)
+        WUP::SetFlashJournal(opt.FlashJournal);
+
     //if (!WUP::LoadFirmware("firmware.bin"))
     //if (!WUP::LoadFirmware("firmware_recent.bin"))
     if (!WUP::LoadBootAndFw("bootloader.bin", "melonpad.fw"))
     {
         printf("failed to load firmware.bin\n");
         WUP::DeInit();
+        EmuStatus = -1;
+        return;
+    }
+
+    // movies start from power-on
+    if (opt.PlayFile)
+        Movie::StartPlayback(opt.PlayFile);
+    else if (opt.RecordFile)
+        Movie::StartRecording(opt.RecordFile);
+
+    WUP::Start();
+    EmuStatus = 1;
+
+    typedef std::chrono::steady_clock Clock;
+    const auto frametime = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(kFrameTime));
+    Clock::time_point nextframe = Clock::now();
+
+    int backbuf = 1;
+    bool turbo = false;
+    while (!EmuQuit)
+    {
+        if (Turbo != turbo)
+        {
+            turbo = Turbo;
+            WUP::SetRenderInterval(turbo ? opt.TurboInterval : 1);
+            nextframe = Clock::now();
+        }
+
+        u32 touch = InputTouch;
+        WUP::SetKeyMask(InputKeys);
+        WUP::SetTouchCoords(touch >> 31, touch & 0xFFFF, (touch >> 16) & 0x7FFF);
+        int vol = InputVolume.exchange(-1);
+        if (vol >= 0)
+            WUP::SetVolume(vol);
+
+        WUP::RunFrame();
+
+        // skipped frames aren't handed over, so they don't get uploaded either
+        if (WUP::IsFrameRendered())
+        {
+            memcpy(FrameBuffers[backbuf], WUP::GetFramebuffer(), kScreenWidth*kScreenHeight*4);
+            backbuf = LatestFrame.exchange(backbuf | kNewFrame) & 3;
+        }
+
+        if (turbo)
+            continue;
+
+        // if we fell behind by more than a few frames, don't try to catch up
+        nextframe += frametime;
+        Clock::time_point now = Clock::now();
+        if (now > (nextframe + 4*frametime))
+            nextframe = now;
+        else
+            std::this_thread::sleep_until(nextframe);
+    }
+
+    WUP::DeInit();
+}
+
+int main(int argc, char** argv)
+{
+    EmuOptions opt;
+    opt.CPUMode = WUP::CPUMode_JIT;
+    opt.RunAhead = 0;
+    opt.RecordFile = nullptr;
+    opt.PlayFile = nullptr;
+    opt.FlashJournal = "melonpad.fw.journal";
+    opt.TurboInterval = kDefaultTurboInterval;
+    bool turbo = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--no-jit"))
+            opt.CPUMode = WUP::CPUMode_CachedInterpreter;
+        else if (!strcmp(argv[i], "--interpreter"))
+            opt.CPUMode = WUP::CPUMode_Interpreter;
+        else if (!strcmp(argv[i], "--record") && (i+1) < argc)
+            opt.RecordFile = argv[++i];
+        else if (!strcmp(argv[i], "--play") && (i+1) < argc)
+            opt.PlayFile = argv[++i];
+        else if (!strcmp(argv[i], "--run-ahead") && (i+1) < argc)
+            opt.RunAhead = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--log-debug") && (i+1) < argc)
+        {
+            // debug messages only exist in debug builds
+            if (!Platform::SetLogLevel(argv[++i], Platform::LogLevel::Debug))
+                printf("unknown log channel %s\n", argv[i]);
+        }
+        else if (!strcmp(argv[i], "--flash-journal") && (i+1) < argc)
+            opt.FlashJournal = argv[++i];
+        else if (!strcmp(argv[i], "--no-flash-journal"))
+            opt.FlashJournal = nullptr;
+        else if (!strcmp(argv[i], "--turbo"))
+            turbo = true;
+        else if (!strcmp(argv[i], "--turbo-skip") && (i+1) < argc)
+            opt.TurboInterval = std::max(1, atoi(argv[++i]));
+        else
+            printf("unknown option %s\n", argv[i]);
+    }
+
+    SDL_Init(SDL_INIT_VIDEO);
+    printf("pomelopad 0.1 or something\n");
+
+    for (int i = 0; i < 3; i++)
+    {
+        FrameBuffers[i] = new u32[kScreenWidth*kScreenHeight];
+        memset(FrameBuffers[i], 0, kScreenWidth*kScreenHeight*4);
+    }
+    LatestFrame = 0;
+    int frontbuf = 2;
+
+    InputKeys = 0;
+    InputTouch = 0;
+    InputVolume = -1;
+    Turbo = turbo;
+    EmuQuit = false;
+    EmuStatus = 0;
+
+    std::thread emuthread(EmuThread, opt);
+    while (EmuStatus == 0)
+        SDL_Delay(1);
+    if (EmuStatus < 0)
+    {
+        emuthread.join();
         SDL_Quit();
         return -1;
     }
@@ -68,23 +243,24 @@ int main()
     SDL_Window* window = SDL_CreateWindow(
         "pomelopad",
         SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        854, 480,
+        kScreenWidth, kScreenHeight,
         0
     );
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // vsync only holds up the frontend
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!renderer)
         renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
 
-    SDL_Texture* framebuf = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 854, 480);
+    SDL_Texture* framebuf = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, kScreenWidth, kScreenHeight);
     if (!framebuf)
     {
         printf("texture shat itself :(\n");
+        EmuQuit = true;
+        emuthread.join();
         return -1;
     }
 
-    WUP::Start();
-
     u32 keymask = 0;
     bool touch = false;
     int touchX = 0, touchY = 0;
@@ -110,13 +286,15 @@ int main()
                         printf("pressed key %d\n", i);
                 }
                 if (evt.key.keysym.scancode == SDL_SCANCODE_Y)
-                    WUP::SetVolume(0);
+                    InputVolume = 0;
                 if (evt.key.keysym.scancode == SDL_SCANCODE_U)
-                    WUP::SetVolume(85);
+                    InputVolume = 85;
                 if (evt.key.keysym.scancode == SDL_SCANCODE_I)
-                    WUP::SetVolume(170);
+                    InputVolume = 170;
                 if (evt.key.keysym.scancode == SDL_SCANCODE_O)
-                    WUP::SetVolume(255);
+                    InputVolume = 255;
+                if (evt.key.keysym.scancode == kTurboKey && !evt.key.repeat)
+                    Turbo = !Turbo;
                 break;
 
             case SDL_KEYUP:
@@ -156,22 +334,28 @@ int main()
         }
         if (quit) break;
 
-        WUP::SetKeyMask(keymask);
-        WUP::SetTouchCoords(touch, touchX, touchY);
+        InputKeys = keymask;
+        InputTouch = (touch ? (1U<<31) : 0) | ((touchY & 0x7FFF) << 16) | (touchX & 0xFFFF);
 
-        // run emulation here
-        WUP::RunFrame();
+        if (!(LatestFrame & kNewFrame))
+        {
+            // nothing new to show
+            SDL_Delay(1);
+            continue;
+        }
+
+        frontbuf = LatestFrame.exchange(frontbuf) & 3;
 
         {
-            u32* src = WUP::GetFramebuffer();
+            u32* src = FrameBuffers[frontbuf];
             u8* dst;
             int stride;
             SDL_LockTexture(framebuf, nullptr, (void**)&dst, &stride);
 
-            for (int y = 0; y < 480; y++)
+            for (int y = 0; y < kScreenHeight; y++)
             {
-                memcpy(dst, src, 854*4);
-                src += 854;
+                memcpy(dst, src, kScreenWidth*4);
+                src += kScreenWidth;
                 dst += stride;
             }
 
@@ -187,12 +371,16 @@ int main()
         SDL_RenderPresent(renderer);
     }
 
+    EmuQuit = true;
+    emuthread.join();
+
     SDL_DestroyTexture(framebuf);
     SDL_DestroyRenderer(renderer);
 
     SDL_DestroyWindow(window);
 
-    WUP::DeInit();
+    for (int i = 0; i < 3; i++)
+        delete[] FrameBuffers[i];
 
     SDL_Quit();
     return 0;
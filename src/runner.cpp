@@ -0,0 +1,461 @@
+/*
+    Copyright 2024 Arisotura
+
+    This file is part of pomelopad.
+
+    pomelopad is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    pomelopad is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with pomelopad. If not, see http://www.gnu.org/licenses/.
+*/
+
+// headless scenario runner
+//
+// boots the given firmware once and runs it up to a given frame. from there,
+// one worker process is forked per scenario, so they all start from the same
+// booted state without having to boot again, and share its memory until they
+// write to it. each worker plays the inputs from its scenario script and
+// reports framebuffer hashes.
+// results are a line of JSON per scenario, in the order they were given.
+//
+// scenario scripts have one command per line. frames are counted from the
+// point the workers are forked at, and inputs apply before the given frame
+// is run:
+// frames <num>             run for this many frames (default: -n)
+// <frame> keys <mask>      set the key mask
+// <frame> touch <x> <y>    touch the screen
+// <frame> release          stop touching the screen
+// <frame> volume <val>     set the volume slider
+// <frame> hash             report the framebuffer hash after this frame
+// the hash after the last frame is always reported. # starts a comment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "WUP.h"
+#include "Platform.h"
+
+typedef std::chrono::steady_clock Clock;
+
+const int kScreenWidth = 854;
+const int kScreenHeight = 480;
+
+enum
+{
+    Cmd_Keys = 0,
+    Cmd_Touch,
+    Cmd_Release,
+    Cmd_Volume,
+    Cmd_Hash,
+};
+
+struct Command
+{
+    u32 Frame;
+    int Type;
+    u32 Args[2];
+};
+
+struct Scenario
+{
+    std::string Filename;
+    u32 NumFrames;
+    std::vector<Command> Commands;
+
+    pid_t PID;
+    int Pipe;
+    std::string Result;
+};
+
+void Usage()
+{
+    printf("usage: pomelopad_runner [options] <firmware.bin> <scenario>...\n");
+    printf("       pomelopad_runner [options] --boot <bootloader.bin> <melonpad.fw> <scenario>...\n");
+    printf("options:\n");
+    printf("  --fork-frame <num>    frame to run up to before starting the scenarios (default 0)\n");
+    printf("  -n, --frames <num>    frames to run per scenario, unless set by the script (default 600)\n");
+    printf("  -j, --jobs <num>      number of scenarios to run at once (default: number of cores)\n");
+    printf("  -o, --output <file>   write the results to a file instead of stdout\n");
+    printf("  --no-jit              use the cached interpreter\n");
+    printf("  --interpreter         use the plain interpreter\n");
+}
+
+bool ParseScenario(Scenario& sc, u32 defaultframes)
+{
+    FILE* f = fopen(sc.Filename.c_str(), "r");
+    if (!f)
+    {
+        printf("failed to open scenario %s\n", sc.Filename.c_str());
+        return false;
+    }
+
+    sc.NumFrames = defaultframes;
+    sc.Commands.clear();
+
+    char line[256];
+    int linenum = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), f))
+    {
+        linenum++;
+
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char name[32];
+        u32 frame, a, b;
+        Command cmd = {};
+        int n;
+
+        if (sscanf(line, " %31s", name) < 1)
+            continue;
+
+        if (sscanf(line, " frames %u", &a) == 1)
+        {
+            sc.NumFrames = a;
+            continue;
+        }
+
+        n = sscanf(line, " %u %31s %i %i", &frame, name, &a, &b);
+        cmd.Frame = frame;
+        if (n == 3 && !strcmp(name, "keys"))
+        {
+            cmd.Type = Cmd_Keys;
+            cmd.Args[0] = a;
+        }
+        else if (n == 4 && !strcmp(name, "touch"))
+        {
+            cmd.Type = Cmd_Touch;
+            cmd.Args[0] = a;
+            cmd.Args[1] = b;
+        }
+        else if (n == 2 && !strcmp(name, "release"))
+        {
+            cmd.Type = Cmd_Release;
+        }
+        else if (n == 3 && !strcmp(name, "volume"))
+        {
+            cmd.Type = Cmd_Volume;
+            cmd.Args[0] = a;
+        }
+        else if (n == 2 && !strcmp(name, "hash"))
+        {
+            cmd.Type = Cmd_Hash;
+        }
+        else
+        {
+            printf("%s:%d: bad command\n", sc.Filename.c_str(), linenum);
+            ok = false;
+            break;
+        }
+
+        sc.Commands.push_back(cmd);
+    }
+
+    fclose(f);
+
+    // commands are applied in order
+    std::stable_sort(sc.Commands.begin(), sc.Commands.end(),
+                     [](const Command& a, const Command& b) { return a.Frame < b.Frame; });
+    return ok;
+}
+
+u64 HashFramebuffer()
+{
+    // FNV-1a
+    const u8* data = (const u8*)WUP::GetFramebuffer();
+    u64 hash = 0xCBF29CE484222325ULL;
+    for (u32 i = 0; i < kScreenWidth*kScreenHeight*4; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// runs in the worker process
+std::string RunScenario(const Scenario& sc)
+{
+    std::string hashes;
+    char buf[64];
+
+    Clock::time_point start = Clock::now();
+
+    size_t next = 0;
+    for (u32 frame = 0; frame < sc.NumFrames; frame++)
+    {
+        bool hash = (frame == sc.NumFrames-1);
+
+        for (; next < sc.Commands.size() && sc.Commands[next].Frame <= frame; next++)
+        {
+            const Command& cmd = sc.Commands[next];
+            switch (cmd.Type)
+            {
+            case Cmd_Keys: WUP::SetKeyMask(cmd.Args[0]); break;
+            case Cmd_Touch: WUP::SetTouchCoords(true, cmd.Args[0], cmd.Args[1]); break;
+            case Cmd_Release: WUP::SetTouchCoords(false, 0, 0); break;
+            case Cmd_Volume: WUP::SetVolume(cmd.Args[0]); break;
+            case Cmd_Hash: hash = true; break;
+            }
+        }
+
+        WUP::RunFrame();
+
+        if (hash)
+        {
+            snprintf(buf, sizeof(buf), "%s{\"frame\": %u, \"hash\": \"%016llx\"}",
+                     hashes.empty() ? "" : ", ", frame, (unsigned long long)HashFramebuffer());
+            hashes += buf;
+        }
+    }
+
+    double hosttime = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::string ret = "\"status\": \"ok\", \"frames\": " + std::to_string(sc.NumFrames);
+    snprintf(buf, sizeof(buf), ", \"host_seconds\": %.6f", hosttime);
+    ret += buf;
+    ret += ", \"hashes\": [" + hashes + "]";
+    return ret;
+}
+
+bool StartWorker(Scenario& sc)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return false;
+
+    // anything buffered would be written again by the child
+    Platform::FlushLog();
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        bool ok = WUP::AfterFork();
+        std::string res = ok ? RunScenario(sc) : "\"status\": \"failed\"";
+
+        const char* data = res.c_str();
+        size_t len = res.size();
+        while (len)
+        {
+            ssize_t n = write(fds[1], data, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            data += n;
+            len -= n;
+        }
+        Platform::FlushLog();
+        _exit(ok ? 0 : 1);
+    }
+
+    close(fds[1]);
+    sc.PID = pid;
+    sc.Pipe = fds[0];
+    return true;
+}
+
+void PrintString(FILE* f, const std::string& str)
+{
+    fputc('"', f);
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\') fputc('\\', f);
+        fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+int main(int argc, char** argv)
+{
+    int cpumode = WUP::CPUMode_JIT;
+    u32 forkframe = 0;
+    u32 numframes = 600;
+    int numjobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char* outfile = nullptr;
+    const char* bootfile = nullptr;
+    std::vector<const char*> files;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--fork-frame") && (i+1) < argc)
+            forkframe = strtoul(argv[++i], nullptr, 0);
+        else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--frames")) && (i+1) < argc)
+            numframes = strtoul(argv[++i], nullptr, 0);
+        else if ((!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) && (i+1) < argc)
+            numjobs = atoi(argv[++i]);
+        else if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) && (i+1) < argc)
+            outfile = argv[++i];
+        else if (!strcmp(argv[i], "--boot") && (i+1) < argc)
+            bootfile = argv[++i];
+        else if (!strcmp(argv[i], "--no-jit"))
+            cpumode = WUP::CPUMode_CachedInterpreter;
+        else if (!strcmp(argv[i], "--interpreter"))
+            cpumode = WUP::CPUMode_Interpreter;
+        else if (argv[i][0] != '-')
+            files.push_back(argv[i]);
+        else
+        {
+            Usage();
+            return 1;
+        }
+    }
+
+    if (files.size() < 2 || !numframes)
+    {
+        Usage();
+        return 1;
+    }
+    if (numjobs < 1) numjobs = 1;
+
+    std::vector<Scenario> scenarios(files.size() - 1);
+    for (size_t i = 0; i < scenarios.size(); i++)
+    {
+        scenarios[i].Filename = files[i+1];
+        if (!ParseScenario(scenarios[i], numframes))
+            return 1;
+    }
+
+    FILE* f = stdout;
+    if (outfile)
+    {
+        f = fopen(outfile, "w");
+        if (!f)
+        {
+            printf("failed to open %s\n", outfile);
+            return 1;
+        }
+    }
+
+    if (!WUP::Init())
+    {
+        printf("failed to initialize the emulator\n");
+        return 1;
+    }
+
+    WUP::SetCPUMode(cpumode);
+
+    bool loaded;
+    if (bootfile)
+        loaded = WUP::LoadBootAndFw(bootfile, files[0]);
+    else
+        loaded = WUP::LoadFirmware(files[0]);
+    if (!loaded)
+    {
+        printf("failed to load firmware\n");
+        WUP::DeInit();
+        return 1;
+    }
+
+    WUP::Start();
+    for (u32 i = 0; i < forkframe; i++)
+        WUP::RunFrame();
+
+    // workers are started as others finish, and their results collected as
+    // they come in
+    size_t nextworker = 0;
+    std::vector<Scenario*> running;
+    std::vector<pollfd> fds;
+    bool allok = true;
+
+    while (nextworker < scenarios.size() || !running.empty())
+    {
+        while (nextworker < scenarios.size() && (int)running.size() < numjobs)
+        {
+            Scenario& sc = scenarios[nextworker++];
+            if (!StartWorker(sc))
+            {
+                printf("failed to start worker for %s\n", sc.Filename.c_str());
+                sc.Result = "\"status\": \"failed\"";
+                allok = false;
+                continue;
+            }
+            running.push_back(&sc);
+        }
+        if (running.empty())
+            break;
+
+        fds.resize(running.size());
+        for (size_t i = 0; i < running.size(); i++)
+        {
+            fds[i].fd = running[i]->Pipe;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (size_t i = running.size(); i-- > 0; )
+        {
+            if (!fds[i].revents) continue;
+
+            Scenario* sc = running[i];
+            char buf[4096];
+            ssize_t n = read(sc->Pipe, buf, sizeof(buf));
+            if (n > 0)
+            {
+                sc->Result.append(buf, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            // the worker is done
+            close(sc->Pipe);
+            int status;
+            waitpid(sc->PID, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || sc->Result.empty())
+            {
+                if (WIFSIGNALED(status))
+                    sc->Result = "\"status\": \"crashed\", \"signal\": " + std::to_string(WTERMSIG(status));
+                else
+                    sc->Result = "\"status\": \"failed\"";
+                allok = false;
+            }
+
+            running.erase(running.begin() + i);
+        }
+    }
+
+    for (const Scenario& sc : scenarios)
+    {
+        fprintf(f, "{\"scenario\": ");
+        PrintString(f, sc.Filename);
+        fprintf(f, ", \"fork_frame\": %u, %s}\n", forkframe, sc.Result.c_str());
+    }
+
+    if (outfile)
+        fclose(f);
+
+    WUP::DeInit();
+    return allok ? 0 : 1;
+}